@@ -0,0 +1,623 @@
+#include "shared.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SINISTER_SECTIONS 5 // each ends with a line of "."
+#define FIRST_PORT 1024 // fake teams claim to wait on ports from here up
+#define STATS_ENV "CONTROLLER_STATS" // where the controller dumps its stats
+
+// A small but complete sinister file. Fake teams only look for where it ends;
+// it just has to satisfy the controller.
+#define SINISTER_FILE "fire\nwater\n.\n" \
+        "fire hot warm cool\nwater wet damp dry\n.\n" \
+        "fire +fire -water\nwater +water -fire\n.\n" \
+        "ember fire\nflame fire\nbubble water\nsurf water\n.\n" \
+        "charm fire ember flame surf\nsquirt water bubble surf ember\n.\n"
+
+// All error exit codes
+enum ExitCodes {
+    EXIT_ARGS = 1,
+    EXIT_INVALID_TEAMS = 2,
+    EXIT_INVALID_ROUNDS = 3,
+    EXIT_START_CONTROLLER = 4,
+    EXIT_CONNECT = 5,
+    EXIT_BAD_MESSAGE = 6,
+    EXIT_SYSTEM = 7
+};
+
+// Messages fake teams get from the controller after the sinister message
+enum Messages {
+    NONE,
+    BATTLE,
+    WHERENOW,
+    GAMEOVERMAN
+};
+
+// The phases of the controller's round, as timed by the controller itself
+enum Phases {
+    TIME_DISPATCH, // send_battle_messages(), with grouping teams into zones
+    TIME_FIGHTING, // read_donefighting_messages(), waiting on every team
+    TIME_MOVING, // "wherenow?" to process_wherenow_messages(), every team
+    NUM_PHASES
+};
+
+// The controller's stats dump names each phase's histogram like this
+const char *phaseNames[NUM_PHASES] = {"dispatch", "donefighting", "wherenow"};
+
+// One phase's latencies, read back from the controller's stats dump
+typedef struct {
+    unsigned long samples;
+    double p50;
+    double p99;
+} PhaseStats;
+
+// One connection to the controller, pretending to be a team
+typedef struct {
+    int fd;
+    char *input; // received but not yet processed
+    int length;
+    int capacity;
+    int sections; // of the sinister file still to come, plus one for the
+                  // "sinister" line
+    bool binary; // speaks binary frames, if the controller offered them
+    enum Messages received; // this phase's message, once it has arrived
+    Coords pos; // from the last battle message
+    int zoneSize; // teams in the same zone this round, including this one
+    char direction; // always travels this way
+} FakeTeam;
+
+// Everything about one benchmark run
+typedef struct {
+    FakeTeam *teams;
+    int numTeams;
+    int rounds;
+    int width;
+    int height;
+    bool binary; // fake teams take up the controller's offer of binary
+    int fdEvents;
+    char *stats; // file the controller dumps its stats to
+    PhaseStats phases[NUM_PHASES];
+    pid_t controller;
+} Bench;
+
+/**
+ * Exits the program with the given status and corresponding error message
+ */
+void exit_bench(int status) {
+    char *message;
+    switch (status) {
+        case EXIT_ARGS:
+            message = "Usage: 2310bench controller teams rounds [binary]";
+            break;
+        case EXIT_INVALID_TEAMS:
+            message = "Invalid number of teams";
+            break;
+        case EXIT_INVALID_ROUNDS:
+            message = "Invalid number of rounds";
+            break;
+        case EXIT_START_CONTROLLER:
+            message = "Unable to start controller";
+            break;
+        case EXIT_CONNECT:
+            message = "Unable to connect to controller";
+            break;
+        case EXIT_BAD_MESSAGE:
+            message = "Protocol error";
+            break;
+        case EXIT_SYSTEM:
+            message = "System error";
+            break;
+        default:
+            message = "Well, this is awkward";
+    }
+    fprintf(stderr, "%s\n", message);
+    exit(status);
+}
+
+/**
+ * Writes contents to a new temporary file and returns its name, which must
+ *      be freed (and the file unlinked).
+ */
+char *write_temp_file(const char *contents) {
+    char *name = strdup("/tmp/2310bench.XXXXXX");
+    int fd = mkstemp(name);
+    if (fd < 0 || write_all(fd, contents, strlen(contents)) != 0) {
+        exit_bench(EXIT_SYSTEM);
+    }
+    close(fd);
+    return name;
+}
+
+/**
+ * Starts the controller at path running one simulation of the benchmark's
+ *      teams on an ephemeral port, and returns that port. The controller
+ *      dumps its stats to bench->stats once the game is over.
+ * Exits with start controller error if it doesn't tell us its port.
+ */
+int start_controller(Bench *bench, char *path, char *sinister) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        exit_bench(EXIT_SYSTEM);
+    }
+    char height[BUFFER], width[BUFFER], rounds[BUFFER], teams[BUFFER];
+    sprintf(height, "%d", bench->height);
+    sprintf(width, "%d", bench->width);
+    sprintf(rounds, "%d", bench->rounds);
+    sprintf(teams, "%d", bench->numTeams);
+    bench->controller = fork();
+    if (bench->controller == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        setenv(STATS_ENV, bench->stats, 1);
+        execl(path, path, height, width, sinister, rounds, "-", teams,
+                (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    FILE *output = fdopen(fds[0], "r");
+    char *line = read_line(malloc(sizeof(char) * BUFFER), BUFFER, output);
+    fclose(output);
+    int port = number(line);
+    free(line);
+    if (bench->controller < 0 || !valid_port(port)) {
+        exit_bench(EXIT_START_CONTROLLER);
+    }
+    return port;
+}
+
+/**
+ * Connects every fake team to the controller. Teams alternate between
+ *      travelling north and east so that zones keep changing.
+ * Exits with connect error if a connection fails.
+ */
+void connect_teams(Bench *bench, int port) {
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bench->fdEvents = epoll_create1(0);
+    if (bench->fdEvents < 0) {
+        exit_bench(EXIT_SYSTEM);
+    }
+
+    for (int i = 0; i < bench->numTeams; i++) {
+        FakeTeam *team = &bench->teams[i];
+        team->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (team->fd < 0 || connect(team->fd, (struct sockaddr *)&address,
+                sizeof(address)) != 0) {
+            exit_bench(EXIT_CONNECT);
+        }
+        team->capacity = BUFFER;
+        team->input = malloc(sizeof(char) * team->capacity);
+        team->length = 0;
+        team->sections = SINISTER_SECTIONS + 1;
+        team->binary = false;
+        team->received = NONE;
+        team->direction = i % 2 == 0 ? 'N' : 'E';
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = team;
+        epoll_ctl(bench->fdEvents, EPOLL_CTL_ADD, team->fd, &event);
+    }
+}
+
+/**
+ * Takes the team's next complete message off its input, if there is one,
+ *      and returns its type (NONE if there isn't one).
+ * Exits with protocol error if the message isn't one a team expects.
+ */
+enum Messages next_message(Bench *bench, FakeTeam *team) {
+    int used;
+    enum Messages type;
+    if (team->binary) {
+        used = frame_size(team->input, team->length);
+        if (used == 0) {
+            return NONE;
+        }
+        unsigned char *payload = (unsigned char *)&team->input[FRAME_HEADER];
+        switch (team->input[0]) {
+            case OP_BATTLE:
+                type = BATTLE;
+                team->pos.x = (int)get_number(&payload[0], 4);
+                team->pos.y = (int)get_number(&payload[4], 4);
+                break;
+            case OP_WHERENOW:
+                type = WHERENOW;
+                break;
+            case OP_GAMEOVERMAN:
+                type = GAMEOVERMAN;
+                break;
+            default:
+                exit_bench(EXIT_BAD_MESSAGE);
+        }
+    } else {
+        char *end = memchr(team->input, '\n', team->length);
+        if (end == NULL) {
+            return NONE;
+        }
+        *end = '\0';
+        used = end - team->input + 1;
+        if (strncmp(team->input, "battle ", strlen("battle ")) == 0) {
+            type = BATTLE;
+            int pos = strlen("battle ");
+            Coords *coords = get_coords(team->input, ' ', &pos);
+            team->pos = *coords;
+            free(coords);
+        } else if (strcmp(team->input, "wherenow?") == 0) {
+            type = WHERENOW;
+        } else if (strcmp(team->input, "gameoverman") == 0) {
+            type = GAMEOVERMAN;
+        } else {
+            exit_bench(EXIT_BAD_MESSAGE);
+        }
+    }
+    team->length -= used;
+    memmove(team->input, &team->input[used], team->length);
+    return type;
+}
+
+/**
+ * Reads whatever the controller has sent the team.
+ * Exits with protocol error if the controller hangs up before "gameoverman".
+ */
+void receive(Bench *bench, FakeTeam *team) {
+    if (team->length == team->capacity) {
+        team->capacity *= 2;
+        team->input = realloc(team->input, sizeof(char) * team->capacity);
+    }
+    ssize_t n = read(team->fd, &team->input[team->length],
+            team->capacity - team->length);
+    if (n < 0 && errno == EINTR) {
+        return;
+    } else if (n <= 0 && team->received == GAMEOVERMAN) {
+        epoll_ctl(bench->fdEvents, EPOLL_CTL_DEL, team->fd, NULL);
+        return; // the controller is done with us
+    } else if (n <= 0) {
+        exit_bench(EXIT_BAD_MESSAGE);
+    }
+    team->length += n;
+}
+
+/**
+ * Takes as much of the sinister message off the team's input as has arrived:
+ *      first the "sinister" line, taking up any offer of binary frames if the
+ *      benchmark wants them, then the sinister file, which ends with its last
+ *      section's "." line. Fake teams don't need the file, so it is only
+ *      read up to there.
+ * Returns true once the whole message has been taken.
+ * Exits with protocol error if the message doesn't start with "sinister".
+ */
+bool take_sinister(Bench *bench, FakeTeam *team) {
+    char *line = team->input;
+    char *end;
+    while (team->sections > 0 && (end = memchr(line, '\n', 
+            team->length - (line - team->input))) != NULL) {
+        *end = '\0';
+        if (team->sections > SINISTER_SECTIONS) {
+            if (strcmp(line, "sinister " BINARY_OFFER) == 0) {
+                team->binary = bench->binary;
+            } else if (strcmp(line, "sinister") != 0) {
+                exit_bench(EXIT_BAD_MESSAGE);
+            }
+            team->sections--;
+        } else if (strcmp(line, ".") == 0) {
+            team->sections--;
+        }
+        line = end + 1;
+    }
+    team->length -= line - team->input;
+    memmove(team->input, line, team->length);
+    return team->sections == 0;
+}
+
+/**
+ * Sends the team's "iwannaplay", in binary frames from then on if it took up
+ *      the controller's offer. Teams are spread evenly over the grid.
+ * Exits with connect error if it can't be sent.
+ */
+void send_iwannaplay(Bench *bench, FakeTeam *team) {
+    int i = team - bench->teams;
+    char message[BUFFER];
+    int length = sprintf(message, "iwannaplay %d %d bench%d %d%s\n",
+            i % bench->width, (i / bench->width) % bench->height, i,
+            FIRST_PORT + i % (MAX_PORT_NUMBER - FIRST_PORT),
+            team->binary ? " " BINARY_OFFER : "");
+    if (write_all(team->fd, message, length) != 0) {
+        exit_bench(EXIT_CONNECT);
+    }
+}
+
+/**
+ * Waits for every team's sinister message, answering each with its
+ *      "iwannaplay" as soon as it has the whole message.
+ */
+void admit_teams(Bench *bench) {
+    struct epoll_event events[BUFFER];
+    int waiting = bench->numTeams;
+    while (waiting > 0) {
+        int n = epoll_wait(bench->fdEvents, events, BUFFER, -1);
+        if (n < 0 && errno != EINTR) {
+            exit_bench(EXIT_SYSTEM);
+        }
+        for (int i = 0; i < n; i++) {
+            FakeTeam *team = events[i].data.ptr;
+            bool admitted = team->sections == 0;
+            receive(bench, team); // anything after the sinister message waits
+            if (!admitted && take_sinister(bench, team)) {
+                send_iwannaplay(bench, team);
+                waiting--;
+            }
+        }
+    }
+}
+
+/**
+ * Sends the team's travel in answer to "wherenow?".
+ * Exits with protocol error if it can't be sent.
+ */
+void travel(FakeTeam *team) {
+    char message[FRAME_HEADER + BUFFER];
+    int length;
+    if (team->binary) {
+        message[0] = OP_TRAVEL;
+        put_number((unsigned char *)&message[1], 1, 2);
+        message[FRAME_HEADER] = team->direction;
+        length = FRAME_HEADER + 1;
+    } else {
+        length = sprintf(message, "travel %c\n", team->direction);
+    }
+    if (write_all(team->fd, message, length) != 0) {
+        exit_bench(EXIT_BAD_MESSAGE);
+    }
+}
+
+/**
+ * Takes this phase's message off the team's input, unless it already has it
+ *      or it hasn't arrived yet. Anything after it waits for the next phase.
+ *      "wherenow?" is answered straight away, since a controller may wait
+ *      for each team's travel before asking the next team.
+ * Returns true if the message has just been taken.
+ */
+bool take_message(Bench *bench, FakeTeam *team) {
+    if (team->received != NONE) {
+        return false;
+    }
+    team->received = next_message(bench, team);
+    if (team->received == WHERENOW) {
+        travel(team);
+    }
+    return team->received != NONE;
+}
+
+/**
+ * Waits until every team has received the phase's message.
+ */
+void await_phase(Bench *bench) {
+    struct epoll_event events[BUFFER];
+    int waiting = bench->numTeams;
+    for (int i = 0; i < bench->numTeams; i++) {
+        if (take_message(bench, &bench->teams[i])) {
+            waiting--; // arrived along with last phase's message
+        }
+    }
+    while (waiting > 0) {
+        int n = epoll_wait(bench->fdEvents, events, BUFFER, -1);
+        if (n < 0 && errno != EINTR) {
+            exit_bench(EXIT_SYSTEM);
+        }
+        for (int i = 0; i < n; i++) {
+            receive(bench, events[i].data.ptr);
+            if (take_message(bench, events[i].data.ptr)) {
+                waiting--;
+            }
+        }
+    }
+}
+
+/**
+ * For qsorting fake teams by the zone they are in
+ */
+int sort_zones(const void *a, const void *b) {
+    const Coords *first = &(*((FakeTeam **)a))->pos;
+    const Coords *second = &(*((FakeTeam **)b))->pos;
+    if (first->x != second->x) {
+        return first->x - second->x;
+    }
+    return first->y - second->y;
+}
+
+/**
+ * Works out how many teams are in each team's zone from where their battle
+ *      messages say they are.
+ */
+void count_zones(Bench *bench, FakeTeam **order) {
+    qsort(order, bench->numTeams, sizeof(FakeTeam *), sort_zones);
+    int first = 0;
+    for (int i = 1; i <= bench->numTeams; i++) {
+        if (i == bench->numTeams || sort_zones(&order[first], &order[i]) != 0) {
+            for (int j = first; j < i; j++) {
+                order[j]->zoneSize = i - first;
+            }
+            first = i;
+        }
+    }
+}
+
+/**
+ * Sends every team's replies to its battle message: a "donefighting" for
+ *      each other team in its zone.
+ */
+void finish_battles(Bench *bench) {
+    char *message = malloc(sizeof(char) * FRAME_HEADER * bench->numTeams +
+            strlen("donefighting\n") * bench->numTeams);
+    for (int i = 0; i < bench->numTeams; i++) {
+        FakeTeam *team = &bench->teams[i];
+        int length = 0;
+        for (int j = 1; j < team->zoneSize; j++) {
+            if (team->binary) {
+                message[length] = OP_DONEFIGHTING;
+                put_number((unsigned char *)&message[length + 1], 0, 2);
+                length += FRAME_HEADER;
+            } else {
+                length += sprintf(&message[length], "donefighting\n");
+            }
+        }
+        team->received = NONE;
+        if (length > 0 && write_all(team->fd, message, length) != 0) {
+            exit_bench(EXIT_BAD_MESSAGE);
+        }
+    }
+    free(message);
+}
+
+/**
+ * Runs every round against the controller: each round, waits for every
+ *      team's battle message and replies, then answers every team's
+ *      "wherenow?", until "gameoverman" arrives.
+ * Returns how long the rounds took (from start, when every team had sent its
+ *      "iwannaplay"), in milliseconds.
+ */
+double run_rounds(Bench *bench, double start) {
+    FakeTeam **order = malloc(sizeof(FakeTeam *) * bench->numTeams);
+    for (int i = 0; i < bench->numTeams; i++) {
+        order[i] = &bench->teams[i];
+    }
+    for (int round = 0; round < bench->rounds; round++) {
+        await_phase(bench);
+        count_zones(bench, order);
+        finish_battles(bench);
+        await_phase(bench);
+        if (bench->teams[0].received == GAMEOVERMAN) {
+            break;
+        }
+        for (int i = 0; i < bench->numTeams; i++) {
+            bench->teams[i].received = NONE; // travel has been sent
+        }
+    }
+    for (int i = 0; i < bench->numTeams; i++) {
+        if (bench->teams[i].received != GAMEOVERMAN) {
+            exit_bench(EXIT_BAD_MESSAGE); // game ended early, or not at all
+        }
+    }
+    free(order);
+    return now_ms() - start;
+}
+
+/**
+ * Reads each phase's latencies back from the controller's stats dump. Phases
+ *      the dump doesn't have (from a controller that doesn't keep stats)
+ *      are left with no samples.
+ */
+void read_phases(Bench *bench) {
+    for (int i = 0; i < NUM_PHASES; i++) {
+        bench->phases[i].samples = 0;
+    }
+    FILE *file = fopen(bench->stats, "r");
+    if (file == NULL) {
+        return;
+    }
+    char *line = malloc(sizeof(char) * BUFFER);
+    while ((line = read_line(line, BUFFER, file))[0] != '\0') {
+        for (int i = 0; i < NUM_PHASES; i++) {
+            PhaseStats *phase = &bench->phases[i];
+            int pos = strspn(line, " ");
+            int length = strlen(phaseNames[i]);
+            if (strncmp(&line[pos], phaseNames[i], length) == 0 &&
+                    line[pos + length] == ':') {
+                sscanf(&line[pos + length + 1], " n %lu mean %*f p50 %lf "
+                        "p99 %lf", &phase->samples, &phase->p50, &phase->p99);
+            }
+        }
+    }
+    free(line);
+    fclose(file);
+}
+
+/**
+ * Prints the benchmark's results on one line: teams, rounds, whether teams
+ *      spoke binary or text (the controller offers all of them the same),
+ *      time to admit every team, rounds per second, then p50 and p99
+ *      latency (ms) of each of the controller's phases ("-" if the
+ *      controller kept no stats).
+ */
+void report(Bench *bench, double admit, double elapsed) {
+    printf("teams %d rounds %d %s admit %.3f ms rounds/s %.1f",
+            bench->numTeams, bench->rounds,
+            bench->teams[0].binary ? "binary" : "text", admit,
+            elapsed > 0 ? bench->rounds * 1000.0 / elapsed : 0.0);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        PhaseStats *phase = &bench->phases[i];
+        if (phase->samples == 0) {
+            printf(" %s p50 - p99 -", phaseNames[i]);
+        } else {
+            printf(" %s p50 %.3f p99 %.3f", phaseNames[i], phase->p50,
+                    phase->p99);
+        }
+    }
+    printf("\n");
+}
+
+/**
+ * Drives a real 2310controller with fake teams that answer each message
+ *      immediately, and reports how fast it runs rounds and how long each
+ *      phase of a round takes, as the controller's own stats time them:
+ *      "dispatch" is send_battle_messages(), "donefighting" is
+ *      read_donefighting_messages() and "wherenow" is sending "wherenow?"
+ *      through process_wherenow_messages().
+ */
+int main(int argc, char **argv) {
+    if (argc < 4 || argc > 5 || (argc == 5 &&
+            strcmp(argv[4], BINARY_OFFER) != 0)) {
+        exit_bench(EXIT_ARGS);
+    }
+    Bench *bench = malloc(sizeof(Bench));
+    bench->numTeams = number(argv[2]);
+    bench->rounds = number(argv[3]);
+    bench->binary = argc == 5;
+    if (bench->numTeams <= 1) {
+        exit_bench(EXIT_INVALID_TEAMS);
+    } else if (bench->rounds <= 0) {
+        exit_bench(EXIT_INVALID_ROUNDS);
+    }
+    // about two teams to a zone
+    bench->width = (int)ceil(sqrt(bench->numTeams / 2.0));
+    bench->height = bench->width;
+    bench->teams = malloc(sizeof(FakeTeam) * bench->numTeams);
+
+    // the controller and us both need a socket per team
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    ignore_sigpipe();
+
+    char *sinister = write_temp_file(SINISTER_FILE);
+    bench->stats = write_temp_file("");
+    int port = start_controller(bench, argv[1], sinister);
+    double start = now_ms();
+    connect_teams(bench, port);
+    admit_teams(bench);
+    double admitted = now_ms();
+    double elapsed = run_rounds(bench, admitted);
+
+    int status;
+    waitpid(bench->controller, &status, 0); // so its stats are all written
+    read_phases(bench);
+    report(bench, admitted - start, elapsed);
+    unlink(sinister);
+    free(sinister);
+    unlink(bench->stats);
+    free(bench->stats);
+    return 0;
+}
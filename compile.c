@@ -0,0 +1,61 @@
+#include "shared.h"
+#include <stdlib.h>
+
+// All error exit codes
+enum ExitCodes {
+    EXIT_ARGS = 1,
+    EXIT_OPEN_FILE = 2,
+    EXIT_FILE_CONTENTS = 3,
+    EXIT_WRITE_IMAGE = 4
+};
+
+/**
+ * Exits the program with the given status and corresponding error message
+ */
+void exit_compile(int status) {
+    char *message;
+    switch (status) {
+        case EXIT_ARGS:
+            message = "Usage: 2310compile sinisterfile imagefile";
+            break;
+        case EXIT_OPEN_FILE:
+            message = "Unable to access sinister file";
+            break;
+        case EXIT_FILE_CONTENTS:
+            message = "Error reading sinister file";
+            break;
+        case EXIT_WRITE_IMAGE:
+            message = "Unable to write image file";
+            break;
+        default:
+            message = "Well, this is awkward";
+    }
+    fprintf(stderr, "%s\n", message);
+    exit(status);
+}
+
+/**
+ * Validates a sinister file and compiles it into a binary sinister image that
+ *      2310controller and 2310team can load in place of the text file.
+ */
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        exit_compile(EXIT_ARGS);
+    }
+    FILE *sinister = fopen(argv[1], "r");
+    if (sinister == NULL) {
+        exit_compile(EXIT_OPEN_FILE);
+    }
+    Game *game = new_game();
+    if (load_sinister_file(game, sinister) != 0) {
+        exit_compile(EXIT_FILE_CONTENTS);
+    }
+    fclose(sinister);
+
+    FILE *image = fopen(argv[2], "wb");
+    if (image == NULL || write_sinister_image(game, image) != 0 ||
+            fclose(image) != 0) {
+        exit_compile(EXIT_WRITE_IMAGE);
+    }
+    return 0;
+}
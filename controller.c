@@ -1,9 +1,18 @@
 #include "shared.h"
 #include <stdlib.h>
 #include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #define MIN_DIMENSION 1
 
+// Set in the environment to a file (or "-" for stderr) to append each
+// simulation's stats to when it ends. SIGUSR1 dumps them there at any time.
+#define STATS_ENV "CONTROLLER_STATS"
+
 // All error exit codes
 enum ExitCodes {
     EXIT_ARGS = 1,
@@ -28,11 +37,68 @@ enum Messages {
     END // used for EOF
 };
 
-// List of teams and number of teams. Used for grouping teams in same zone.
+// Where a simulation is up to. Simulations advance through these whenever
+// the teams they are waiting on have replied.
+enum Phases {
+    ADMITTING, // accepting teams and waiting for "iwannaplay"
+    FIGHTING, // battle messages sent, waiting for "donefighting"
+    MOVING, // "wherenow?" sent, waiting for "travel"
+    OVER // "gameoverman" sent
+};
+
+// The parts of a round that are timed
+enum TimedPhases {
+    TIME_DISPATCH, // grouping teams into zones and sending battle messages
+    TIME_FIGHTING, // from then until every "donefighting" has been read
+    TIME_MOVING, // from sending "wherenow?" until every travel is applied
+    NUM_TIMED_PHASES
+};
+
+// Runs every simulation on a fixed pool of worker threads. Each simulation's
+// epoll instance is watched (one shot) by the pool's epoll instance, so at
+// most one worker steps a simulation at a time.
 typedef struct {
-    Team **teams;
-    int numTeams;
-} GroupedTeams;
+    int fdSimulations;
+    int active; // simulations not yet over
+    Simulation **simulations; // for dumping stats
+    int numSimulations;
+} Scheduler;
+
+// How long a simulation's rounds, phases and teams take. Histograms are in
+// shared.c; each phase also notes which team replied last.
+typedef struct Stats {
+    int id; // which simulation, in the order given on the command line
+    Histogram phases[NUM_TIMED_PHASES];
+    Histogram rounds;
+    Histogram replies; // from each phase starting to each team's reply
+    double roundStart;
+    double phaseStart;
+    Team *slowest; // the team that has replied last in this phase so far
+    double slowestReply;
+    FILE *output; // where stats are dumped
+    bool dumpAtEnd; // dump once the simulation is over, not just on SIGUSR1
+} Stats;
+
+// Input received from a team that hasn't been consumed yet. Filled by the
+// event loop as data arrives, in whatever order teams send it. Also tracks
+// how much of the sinister message is still to be sent during admission.
+typedef struct Inbox {
+    int fd;
+    char *data;
+    int length;
+    int capacity;
+    int messages; // complete messages (lines or frames) in data
+    int scanned; // how much of data has been split into messages
+    int needed; // messages the current phase is waiting on
+    bool closed; // EOF or error seen; no more data will arrive
+    const char *unsent; // rest of the sinister message still to be sent
+    size_t unsentSize;
+    bool replied; // has all the current phase is waiting on
+    int replies; // phases this team has had to reply in
+    double replyTotal; // ms
+    double replyMax; // ms
+    int slowest; // phases this team was the last to reply in
+} Inbox;
 
 /**
  * Exits the program with the given status and corresponding error message
@@ -117,16 +183,10 @@ void setup_simulation(Simulation *sim, char *rounds, char *port, char *teams) {
 }
 
 /**
- * Reads a message from the given file stream and returns its type.
+ * Returns the type of the given message.
  * Exits with protocol error if the message doesn't conform to any type.
  */
-enum Messages read_msg(char *result, int length, FILE *file) {
-    int c = fgetc(file);
-    if (c == EOF) {
-        return END;
-    }
-    ungetc(c, file);
-    read_line(result, length, file);
+enum Messages parse_msg(char *result) {
     enum Messages messageType = -1;
     char *type = get_token(result, ' ');
     if (strcmp(type, "iwannaplay") == 0) {
@@ -145,10 +205,304 @@ enum Messages read_msg(char *result, int length, FILE *file) {
 }
 
 /**
- * For qsorting teams alphabetically by name
+ * Starts buffering input from the given team's socket through the
+ *      simulation's event loop.
+ */
+void watch_team(Simulation *sim, Team *team, int fd) {
+    Inbox *inbox = malloc(sizeof(Inbox));
+    inbox->fd = fd;
+    inbox->capacity = BUFFER;
+    inbox->data = malloc(sizeof(char) * inbox->capacity);
+    inbox->length = 0;
+    inbox->messages = 0;
+    inbox->scanned = 0;
+    inbox->needed = 0;
+    inbox->closed = false;
+    inbox->unsent = NULL;
+    inbox->unsentSize = 0;
+    inbox->replied = false;
+    inbox->replies = 0;
+    inbox->replyTotal = 0;
+    inbox->replyMax = 0;
+    inbox->slowest = 0;
+    team->inbox = inbox;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = team;
+    if (epoll_ctl(sim->fdEvents, EPOLL_CTL_ADD, fd, &event) < 0) {
+        exit_game(EXIT_SYSTEM);
+    }
+}
+
+/**
+ * Counts the complete messages newly found in the team's inbox: lines, or
+ *      frames if the team speaks binary.
+ */
+void count_messages(Team *team) {
+    Inbox *inbox = team->inbox;
+    while (inbox->scanned < inbox->length) {
+        char *start = inbox->data + inbox->scanned;
+        int remaining = inbox->length - inbox->scanned;
+        if (team->binary) {
+            int size = frame_size(start, remaining);
+            if (size == 0) {
+                break; // rest of the frame is still to come
+            }
+            inbox->scanned += size;
+        } else {
+            char *newline = memchr(start, '\n', remaining);
+            if (newline == NULL) {
+                inbox->scanned = inbox->length;
+                break;
+            }
+            inbox->scanned += newline - start + 1;
+        }
+        inbox->messages++;
+    }
+}
+
+/**
+ * Reads everything currently available from the team without blocking.
  */
-int sort_teams(const void *a, const void *b) {
-    return strcmp((*((Team **)a))->name, (*((Team **)b))->name);
+void fill_inbox(Simulation *sim, Team *team) {
+    Inbox *inbox = team->inbox;
+    while (!inbox->closed) {
+        if (inbox->capacity - inbox->length < BUFFER) {
+            inbox->capacity *= 2;
+            inbox->data = realloc(inbox->data, inbox->capacity);
+        }
+        ssize_t n = recv(inbox->fd, inbox->data + inbox->length, 
+                inbox->capacity - inbox->length, MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break; // nothing more for now
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            // team has gone; stop watching so we don't spin on it
+            inbox->closed = true;
+            epoll_ctl(sim->fdEvents, EPOLL_CTL_DEL, inbox->fd, NULL);
+            break;
+        }
+        inbox->length += n;
+    }
+    count_messages(team);
+}
+
+/**
+ * Sends as much of the team's remaining sinister message as the socket will
+ *      take without blocking. Stops watching for writability once it is all
+ *      sent (or the team has gone).
+ */
+void send_sinister(Simulation *sim, Team *team) {
+    Inbox *inbox = team->inbox;
+    while (inbox->unsentSize > 0) {
+        ssize_t n = send(inbox->fd, inbox->unsent, inbox->unsentSize, 
+                MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // socket full; wait to be told it's writable
+        } else if (n < 0) {
+            break; // team has gone; we'll see EOF when reading
+        }
+        inbox->unsent += n;
+        inbox->unsentSize -= n;
+    }
+    inbox->unsentSize = 0;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = team;
+    epoll_ctl(sim->fdEvents, EPOLL_CTL_MOD, inbox->fd, &event);
+}
+
+/**
+ * True if the team has sent everything the current phase is waiting on.
+ */
+bool inbox_ready(Team *team) {
+    Inbox *inbox = team->inbox;
+    return inbox->messages >= inbox->needed || inbox->closed;
+}
+
+/**
+ * True if every team in the simulation has sent what the current phase is 
+ *      waiting on (or disconnected).
+ */
+bool teams_ready(Simulation *sim) {
+    for (int i = 0; i < sim->numTeams; i++) {
+        if (!inbox_ready(sim->teams[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sets up the simulation's stats, to be dumped to output.
+ */
+void new_stats(Simulation *sim, int id, FILE *output, bool dumpAtEnd) {
+    Stats *stats = malloc(sizeof(Stats));
+    stats->id = id;
+    for (int i = 0; i < NUM_TIMED_PHASES; i++) {
+        init_histogram(&stats->phases[i]);
+    }
+    init_histogram(&stats->rounds);
+    init_histogram(&stats->replies);
+    stats->output = output;
+    stats->dumpAtEnd = dumpAtEnd;
+    sim->stats = stats;
+}
+
+/**
+ * Starts timing a phase that waits on the teams, and their replies to it.
+ */
+void start_phase(Simulation *sim) {
+    Stats *stats = sim->stats;
+    stats->phaseStart = now_ms();
+    stats->slowest = NULL;
+    stats->slowestReply = 0;
+    for (int i = 0; i < sim->numTeams; i++) {
+        sim->teams[i]->inbox->replied = false;
+    }
+}
+
+/**
+ * Notes how long the team took to reply, if it has just sent all that the
+ *      current phase is waiting on. Teams the phase isn't waiting on aren't
+ *      counted.
+ */
+void note_reply(Simulation *sim, Team *team) {
+    Inbox *inbox = team->inbox;
+    if ((sim->phase != FIGHTING && sim->phase != MOVING) || inbox->replied ||
+            inbox->needed == 0 || !inbox_ready(team)) {
+        return;
+    }
+    Stats *stats = sim->stats;
+    double reply = now_ms() - stats->phaseStart;
+    inbox->replied = true;
+    inbox->replies++;
+    inbox->replyTotal += reply;
+    if (reply > inbox->replyMax) {
+        inbox->replyMax = reply;
+    }
+    record_latency(&stats->replies, reply);
+    if (reply >= stats->slowestReply) {
+        stats->slowest = team;
+        stats->slowestReply = reply;
+    }
+}
+
+/**
+ * Records how long the phase took, and which team held it up.
+ */
+void end_phase(Simulation *sim, enum TimedPhases phase) {
+    Stats *stats = sim->stats;
+    record_latency(&stats->phases[phase], now_ms() - stats->phaseStart);
+    if (stats->slowest != NULL) {
+        stats->slowest->inbox->slowest++;
+    }
+}
+
+/**
+ * Records how long the round took.
+ */
+void end_round(Simulation *sim) {
+    record_latency(&sim->stats->rounds, now_ms() - sim->stats->roundStart);
+}
+
+/**
+ * Dumps the simulation's stats: where it is up to, a histogram of each phase,
+ *      whole rounds and team replies, then each team's replies.
+ */
+void dump_stats(Simulation *sim) {
+    Stats *stats = sim->stats;
+    FILE *file = stats->output;
+    char *phases[] = {"admitting", "fighting", "moving", "over"};
+    flockfile(file);
+    fprintf(file, "simulation %d: round %d of %d, %s\n", stats->id,
+            sim->round + 1, sim->rounds, phases[sim->phase]);
+    print_histogram(file, "  dispatch", &stats->phases[TIME_DISPATCH]);
+    print_histogram(file, "  donefighting", &stats->phases[TIME_FIGHTING]);
+    print_histogram(file, "  wherenow", &stats->phases[TIME_MOVING]);
+    print_histogram(file, "  round", &stats->rounds);
+    print_histogram(file, "  replies", &stats->replies);
+    for (int i = 0; sim->phase != ADMITTING && i < sim->numTeams; i++) {
+        Team *team = sim->teams[i];
+        Inbox *inbox = team->inbox;
+        fprintf(file, "  team %s: replies %d mean %.3f max %.3f ms, "
+                "slowest %d\n", team->name, inbox->replies,
+                inbox->replies > 0 ? inbox->replyTotal / inbox->replies : 0,
+                inbox->replyMax, inbox->slowest);
+    }
+    fflush(file);
+    funlockfile(file);
+}
+
+/**
+ * Removes the next binary frame from the team's inbox and returns the type of
+ *      message it holds. result is set to a malloc'd, nul terminated copy of
+ *      the frame's payload, which the caller must free.
+ * Exits with protocol error if the frame is cut short or of an unknown type.
+ */
+enum Messages next_frame(Team *team, char **result) {
+    Inbox *inbox = team->inbox;
+    int size = frame_size(inbox->data, inbox->length);
+    if (size == 0) {
+        exit_game(EXIT_BAD_MESSAGE); // team went mid-frame
+    }
+    enum Messages messageType = -1;
+    switch (inbox->data[0]) {
+        case OP_DONEFIGHTING:
+            messageType = DONEFIGHTING;
+            break;
+        case OP_DISCO:
+            messageType = DISCO;
+            break;
+        case OP_TRAVEL:
+            messageType = TRAVEL;
+            break;
+        default:
+            exit_game(EXIT_BAD_MESSAGE);
+    }
+    *result = malloc(sizeof(char) * (size - FRAME_HEADER + 1));
+    memcpy(*result, inbox->data + FRAME_HEADER, size - FRAME_HEADER);
+    (*result)[size - FRAME_HEADER] = '\0';
+    memmove(inbox->data, inbox->data + size, inbox->length - size);
+    inbox->length -= size;
+    inbox->scanned -= size;
+    inbox->messages--;
+    return messageType;
+}
+
+/**
+ * Removes the next message from the team's inbox and returns its type.
+ * result is set to a malloc'd copy of the message (without newline), or of 
+ *      the frame's payload if the team speaks binary, which the caller must 
+ *      free. A final line with no newline counts as a message.
+ * Returns END if the team has disconnected and nothing is left.
+ * Exits with protocol error if the message doesn't conform to any type.
+ */
+enum Messages next_msg(Team *team, char **result) {
+    Inbox *inbox = team->inbox;
+    if (inbox->length == 0) {
+        *result = NULL;
+        return END;
+    } else if (team->binary) {
+        return next_frame(team, result);
+    }
+    char *newline = memchr(inbox->data, '\n', inbox->length);
+    int length = newline == NULL ? inbox->length : newline - inbox->data;
+    int used = newline == NULL ? length : length + 1;
+    *result = malloc(sizeof(char) * (length + 1));
+    memcpy(*result, inbox->data, length);
+    (*result)[length] = '\0';
+    memmove(inbox->data, inbox->data + used, inbox->length - used);
+    inbox->length -= used;
+    inbox->scanned -= used;
+    if (newline != NULL) {
+        inbox->messages--;
+    }
+    return parse_msg(*result);
 }
 
 /**
@@ -157,29 +511,37 @@ int sort_teams(const void *a, const void *b) {
 void send_gameoverman(Simulation *sim) {
     for (int i = 0; i < sim->numTeams; i++) {
         Team *team = sim->teams[i];
-        fprintf(team->write, "gameoverman\n");
+        if (team->binary) {
+            write_frame(team->write, OP_GAMEOVERMAN, NULL, 0);
+        } else {
+            fprintf(team->write, "gameoverman\n");
+        }
         fflush(team->write);
     }
 }
 
 /** 
- * Reads all end of battle messages.
+ * Reads all end of battle messages from teams in the given zones.
  * Exits with a protocol error if an invalid message is received.
  * Exits with status 0 and sends "gameoverman" to all players if disco received
  */
-void read_donefighting_messages(Simulation *sim) {
-    char *message = malloc(sizeof(char) * BUFFER);
+void read_donefighting_messages(Simulation *sim, GroupedTeams *zones, 
+        int numZones) {
+    char *message;
     bool endEarly = false;
 
     // find teams who would have battled
-    for (int i = 0; i < sim->numTeams; i++) {
-        Team *a = sim->teams[i];
-        for (int j = i + 1; j < sim->numTeams; j++) {
-            Team *b = sim->teams[j];
-            if (a->pos->x == b->pos->x && a->pos->y == b->pos->y) {
+    for (int i = 0; i < numZones; i++) {
+        GroupedTeams *group = &zones[i];
+        for (int j = 0; j < group->numTeams; j++) {
+            Team *a = group->teams[j];
+            for (int k = j + 1; k < group->numTeams; k++) {
                 // two teams in same grid square - get their messages
-                enum Messages typeA = read_msg(message, BUFFER, a->read);
-                enum Messages typeB = read_msg(message, BUFFER, b->read);
+                Team *b = group->teams[k];
+                enum Messages typeA = next_msg(a, &message);
+                free(message);
+                enum Messages typeB = next_msg(b, &message);
+                free(message);
                 if (typeA == DONEFIGHTING && typeB == DONEFIGHTING) {
                     continue; // both teams are all good
                 } else if ((typeA == DISCO && typeB == END) || 
@@ -196,141 +558,130 @@ void read_donefighting_messages(Simulation *sim) {
         send_gameoverman(sim);
         exit(0);
     }
-    free(message);
 }
 
 /**
- * Returns a list of grouped teams by zone. Populates numZones with the number
- *      of zones containing a team.
+ * Sends a battle message to team, listing the ports of the opponents it is to
+ *      challenge. Binary frames also say which of those opponents speak 
+ *      binary, so that team can challenge them in it.
  */
-GroupedTeams **get_grouped_teams(Simulation *sim, int *numZones) {
-    GroupedTeams **teamGroups = NULL;
-    for (int i = 0; i < sim->numTeams; i++) {
-        // add each team to a group
-        bool placed = false;
-        Team *a = sim->teams[i];
-        for (int j = 0; j < *numZones; j++) {
-            Team *b = teamGroups[j]->teams[0];
-            if (b->pos->x == a->pos->x && b->pos->y == a->pos->y) {
-                teamGroups[j]->teams = realloc(teamGroups[j]->teams, 
-                        sizeof(Team *) * (++(teamGroups[j]->numTeams)));
-                teamGroups[j]->teams[teamGroups[j]->numTeams - 1] = a;
-                placed = true;
-                break; // we've found an existing group to add them to
-            }
-        }
-        if (!placed) {
-            // add to new group 
-            GroupedTeams *group = malloc(sizeof(GroupedTeams));
-            group->numTeams = 1;
-            group->teams = malloc(sizeof(Team *));
-            group->teams[0] = a;
-            (*numZones)++;
-            teamGroups = realloc(teamGroups, sizeof(GroupedTeams *) * 
-                    *numZones);
-            teamGroups[(*numZones) - 1] = group;
+void send_battle_message(Team *team, Team **opponents, int numOpponents) {
+    if (!team->binary) {
+        fprintf(team->write, "battle %d %d", team->pos->x, team->pos->y);
+        for (int i = 0; i < numOpponents; i++) {
+            fprintf(team->write, " %d", opponents[i]->port);
         }
+        fprintf(team->write, "\n");
+        fflush(team->write);
+        return;
+    }
+    int size = 8 + 3 * numOpponents;
+    unsigned char *payload = malloc(sizeof(char) * size);
+    put_number(&payload[0], team->pos->x, 4);
+    put_number(&payload[4], team->pos->y, 4);
+    for (int i = 0; i < numOpponents; i++) {
+        put_number(&payload[8 + 3 * i], opponents[i]->port, 2);
+        payload[8 + 3 * i + 2] = opponents[i]->binary;
     }
-    return teamGroups;
+    write_frame(team->write, OP_BATTLE, payload, size);
+    fflush(team->write);
+    free(payload);
 }
 
 /**
- * Sends battle messages to all team members in the given simulation.
+ * Sends battle messages to all team members in the given zones. Each team
+ *      then owes one "donefighting" per other team in its zone.
  */
-void send_battle_messages(Simulation *sim) {
-    int numZones = 0;
-    GroupedTeams **teams = get_grouped_teams(sim, &numZones);
+void send_battle_messages(GroupedTeams *zones, int numZones) {
+    for (int i = 0; i < numZones; i++) {
+        for (int j = 0; j < zones[i].numTeams; j++) {
+            zones[i].teams[j]->inbox->needed = zones[i].numTeams - 1;
+        }
+    }
 
     // Send battle coords to all teams in each zone
     for (int i = 0; i < numZones; i++) {
-        GroupedTeams *group = teams[i];
-        // message all but last team in zone
+        GroupedTeams *group = &zones[i];
+        // message all but last team in zone, who each challenge the teams 
+        // between them and the last
         for (int j = 0; j < group->numTeams - 1; j++) {
-            Team *a = group->teams[j];
-            fprintf(a->write, "battle %d %d", a->pos->x, a->pos->y);
-            for (int k = j + 1; k < group->numTeams - 1; k++) {
-                Team *b = group->teams[k];
-                fprintf(a->write, " %d", b->port);
-            }
-            fprintf(a->write, "\n");
-            fflush(a->write);
+            send_battle_message(group->teams[j], &group->teams[j + 1], 
+                    group->numTeams - j - 2);
         }
-        // message last team in zone
-        Team *last = group->teams[group->numTeams - 1];
-        fprintf(last->write, "battle %d %d", last->pos->x, last->pos->y);
-        for (int j = 0; j < group->numTeams - 1; j++) {
-            Team *b = group->teams[j];
-            if (last->pos->x == b->pos->x && last->pos->y == b->pos->y) {
-                fprintf(last->write, " %d", b->port);
-            }
+        // message last team in zone, who challenges everyone else
+        send_battle_message(group->teams[group->numTeams - 1], group->teams,
+                group->numTeams - 1);
+    }
+}
+
+/**
+ * Asks every participant which direction they are going. All teams are asked 
+ *      before any reply is read, so they answer concurrently.
+ */
+void send_wherenow_messages(Simulation *sim) {
+    for (int j = 0; j < sim->numTeams; j++) {
+        Team *team = sim->teams[j];
+        if (team->binary) {
+            write_frame(team->write, OP_WHERENOW, NULL, 0);
+        } else {
+            fprintf(team->write, "wherenow?\n");
         }
-        fprintf(last->write, "\n");
-        fflush(last->write);
+        fflush(team->write);
+        team->inbox->needed = 1;
     }
 }
 
 /**
- * Asks participants which direction they are going, and updates their location
- *      based on their response.
+ * Updates participants' locations based on their responses to "wherenow?".
+ *      Moves are applied in sorted team order.
  * Exits with protocol error if a communication error occurs.
  */
 void process_wherenow_messages(Simulation *sim) {
-    char *message = malloc(sizeof(char) * BUFFER);
+    char *message;
     for (int j = 0; j < sim->numTeams; j++) {
-        // send "wherenow?"
         Team *team = sim->teams[j];
-        fprintf(team->write, "wherenow?\n");
-        fflush(team->write);
-        // get their response
-        if (read_msg(message, BUFFER, team->read) != TRAVEL ||
-                strlen(message) != strlen("travel d")) {
+        if (next_msg(team, &message) != TRAVEL || strlen(message) != 
+                (team->binary ? 1 : strlen("travel d"))) {
             exit_game(EXIT_BAD_MESSAGE);
         }
-        switch(message[strlen("travel ")]) {
-            case 'N':
-                team->pos->y += 1;
-                break;
-            case 'E':
-                team->pos->x += 1;
-                break;
-            case 'S':
-                team->pos->y -= 1;
-                break;
-            case 'W':
-                team->pos->x -= 1;
-                break;
-            default:
-                exit_game(EXIT_BAD_MESSAGE);
-        }
-        if (team->pos->x < 0) {
-            team->pos->x = sim->width - 1;
-        } else if (team->pos->y < 0) {
-            team->pos->y = sim->height - 1;
+        if (!move_team(sim, team, 
+                message[team->binary ? 0 : strlen("travel ")])) {
+            exit_game(EXIT_BAD_MESSAGE);
         }
-        team->pos->x = team->pos->x % sim->width;
-        team->pos->y = team->pos->y % sim->height;
+        free(message);
     }
-    free(message);
 }
 
 /**
- * Accepts a connection from a team, runs through setup messages, 
- *   and populates team with data received.
- * Exits with protocol error if invalid data received.
+ * Accepts a connection from a team and starts sending it the cached sinister
+ *      message without waiting for it to be taken.
  */
 void connect_team(Simulation *sim, Team *team) {
-    // connect and send sinister file
-    accept_connection(sim->fdServer, &team->read, &team->write);
-    char *message = malloc(sizeof(char) * BUFFER);
-    FILE *sinister = fopen(sim->sinFilename, "r");
-    fprintf(team->write, "sinister\n");
-    while (fgets(message, BUFFER, sinister) != NULL) {
-        fprintf(team->write, "%s", message);
+    int fd = accept_connection(sim->fdServer, &team->read, &team->write);
+    if (fd < 0) {
+        exit_game(EXIT_SYSTEM);
     }
-    fflush(team->write);
+    watch_team(sim, team, fd);
+    team->inbox->unsent = sim->sinPayload;
+    team->inbox->unsentSize = sim->sinPayloadSize;
+    team->inbox->needed = 1; // "iwannaplay"
 
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = team;
+    epoll_ctl(sim->fdEvents, EPOLL_CTL_MOD, fd, &event);
+    send_sinister(sim, team);
+}
+
+/**
+ * Populates team with the data from its "iwannaplay" message.
+ * Exits with protocol error if invalid data received.
+ */
+void admit_team(Simulation *sim, Team *team) {
     // get coords from "iwannaplay" message
-    if (read_msg(message, BUFFER, team->read) != IWANNAPLAY) {
+    char *message;
+    team->inbox->needed = 0;
+    if (next_msg(team, &message) != IWANNAPLAY) {
         exit_game(EXIT_BAD_MESSAGE);
     }
     int pos = strlen("iwannaplay ");
@@ -346,41 +697,234 @@ void connect_team(Simulation *sim, Team *team) {
     if (pos >= strlen(message)) {
         exit_game(EXIT_BAD_MESSAGE); // not enough info
     }
-    char *portVal = get_token_update_pos(message, '\0', &pos);
+    char *portVal = get_token_update_pos(message, ' ', &pos);
     team->port = number(portVal);
     free(portVal);
     if (!valid_port(team->port)) {
         exit_game(EXIT_BAD_MESSAGE);
     }
+
+    // teams accept our offer of binary frames after their port; anything
+    // else after it, even an empty token, is malformed
+    if (pos <= strlen(message)) {
+        if (strcmp(&message[pos], BINARY_OFFER) != 0) {
+            exit_game(EXIT_BAD_MESSAGE);
+        }
+        team->binary = true;
+    }
     free(message);
 }
 
 /**
- * Runs a simulation
+ * Handles whatever is ready on the simulation's sockets without blocking:
+ *      accepts new teams, sends sinister messages and buffers team input.
+ *      While admitting, each team is admitted as soon as its "iwannaplay"
+ *      arrives.
+ * Exits with protocol error if invalid data received.
+ */
+void handle_events(Simulation *sim) {
+    struct epoll_event events[BUFFER];
+    int n = epoll_wait(sim->fdEvents, events, BUFFER, 0);
+    for (int i = 0; i < n; i++) {
+        Team *team = events[i].data.ptr;
+        if (team == NULL) {
+            // new connection on the listening socket
+            team = sim->teams[sim->connected++] = malloc(sizeof(Team));
+            team->binary = false;
+            connect_team(sim, team);
+            if (sim->connected == sim->numTeams) {
+                epoll_ctl(sim->fdEvents, EPOLL_CTL_DEL, sim->fdServer, 
+                        NULL); // leave any more in the backlog
+            }
+        }
+        if (events[i].events & EPOLLOUT) {
+            send_sinister(sim, team);
+        }
+        fill_inbox(sim, team);
+        note_reply(sim, team);
+        if (sim->phase == ADMITTING && team->inbox->needed > 0 && 
+                inbox_ready(team)) {
+            admit_team(sim, team);
+            sim->admitted++;
+        }
+    }
+}
+
+/**
+ * Returns the complete "sinister" message (header line and sinister file) sent
+ *      to every team, and sets size to its length. Built once and shared by
+ *      all simulations. Compiled images are rendered as text, since that is
+ *      all teams understand.
+ */
+char *build_sinister_payload(Game *game, FILE *sinister, size_t *size) {
+    char *payload = NULL;
+    FILE *stream = open_memstream(&payload, size);
+    if (stream == NULL) {
+        exit_game(EXIT_SYSTEM);
+    }
+    fprintf(stream, "sinister %s\n", BINARY_OFFER);
+    if (game->compiled) {
+        write_sinister_text(game, stream);
+    } else {
+        char buffer[BUFSIZ];
+        size_t n;
+        rewind(sinister);
+        while ((n = fread(buffer, sizeof(char), BUFSIZ, sinister)) > 0) {
+            fwrite(buffer, sizeof(char), n, stream);
+        }
+    }
+    if (fclose(stream) != 0) {
+        exit_game(EXIT_SYSTEM);
+    }
+    return payload;
+}
+
+/**
+ * Starts listening for the simulation's teams through its own epoll instance.
  */
-void *run_simulation(void *args) {
-    // accept a connection from each team, and send setup info 
-    Simulation *sim = (Simulation *) args;
+void start_simulation(Simulation *sim) {
+    sim->fdEvents = epoll_create1(0);
+    if (sim->fdEvents < 0) {
+        exit_game(EXIT_SYSTEM);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // the listening socket
+    if (epoll_ctl(sim->fdEvents, EPOLL_CTL_ADD, sim->fdServer, &event) < 0) {
+        exit_game(EXIT_SYSTEM);
+    }
     sim->teams = malloc(sizeof(Team *) * sim->numTeams);
-    for (int i = 0; i < sim->numTeams; i++) {
-        sim->teams[i] = malloc(sizeof(Team));
-        connect_team(sim, sim->teams[i]);
-    }
-    // sort teams alphabetically
-    qsort(sim->teams, sim->numTeams, sizeof(Team *), sort_teams);
-
-    // run each round in the simulation
-    for (int round = 0; round < sim->rounds; round++) {
-        send_battle_messages(sim);
-        read_donefighting_messages(sim);
-        if (round == sim->rounds - 1) {
-            // last round - send all gameover messages
-            send_gameoverman(sim);
-            pthread_exit(0);
+    sim->connected = 0;
+    sim->admitted = 0;
+    sim->round = 0;
+    sim->phase = ADMITTING;
+}
+
+/**
+ * Sends out the current round's battle messages.
+ */
+void start_round(Simulation *sim) {
+    Stats *stats = sim->stats;
+    stats->roundStart = now_ms();
+    int numZones;
+    GroupedTeams *zones = get_grouped_teams(sim, &numZones);
+    send_battle_messages(zones, numZones);
+    record_latency(&stats->phases[TIME_DISPATCH], now_ms() - stats->roundStart);
+    start_phase(sim);
+    sim->phase = FIGHTING;
+}
+
+/**
+ * Runs a simulation as far as it can go without blocking: handles any ready 
+ *      events, then moves through as many phases as the teams' replies allow.
+ * Returns true once the simulation is over.
+ */
+bool step_simulation(Simulation *sim) {
+    handle_events(sim);
+    while (true) {
+        switch (sim->phase) {
+            case ADMITTING:
+                if (sim->admitted < sim->numTeams) {
+                    return false;
+                }
+                // sort teams alphabetically
+                qsort(sim->teams, sim->numTeams, sizeof(Team *), sort_teams);
+                new_zones(sim);
+                start_round(sim);
+                break;
+            case FIGHTING:
+                if (!teams_ready(sim)) {
+                    return false;
+                }
+                read_donefighting_messages(sim, sim->zones->groups, 
+                        sim->zones->numZones);
+                end_phase(sim, TIME_FIGHTING);
+                if (sim->round == sim->rounds - 1) {
+                    // last round - send all gameover messages
+                    end_round(sim);
+                    send_gameoverman(sim);
+                    sim->phase = OVER;
+                    if (sim->stats->dumpAtEnd) {
+                        dump_stats(sim);
+                    }
+                    return true;
+                }
+                start_phase(sim);
+                send_wherenow_messages(sim);
+                sim->phase = MOVING;
+                break;
+            case MOVING:
+                if (!teams_ready(sim)) {
+                    return false;
+                }
+                process_wherenow_messages(sim);
+                end_phase(sim, TIME_MOVING);
+                end_round(sim);
+                sim->round++;
+                start_round(sim);
+                break;
+            default:
+                return true;
         }
-        process_wherenow_messages(sim);
-    } 
-    return NULL;
+    }
+}
+
+/**
+ * Watches the simulation's events through the scheduler. Whichever worker
+ *      is woken by them has sole use of the simulation until it re-arms it.
+ */
+void schedule_simulation(Scheduler *scheduler, Simulation *sim, int op) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = sim;
+    if (epoll_ctl(scheduler->fdSimulations, op, sim->fdEvents, &event) < 0) {
+        exit_game(EXIT_SYSTEM);
+    }
+}
+
+/**
+ * Worker thread: steps whichever simulation has events ready, forever.
+ * Exits the program with status 0 once every simulation is over.
+ * args should be a Scheduler *.
+ */
+void *run_worker(void *args) {
+    Scheduler *scheduler = (Scheduler *)args;
+    while (true) {
+        struct epoll_event event;
+        int n = epoll_wait(scheduler->fdSimulations, &event, 1, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            exit_game(EXIT_SYSTEM);
+        }
+        Simulation *sim = event.data.ptr;
+        if (!step_simulation(sim)) {
+            schedule_simulation(scheduler, sim, EPOLL_CTL_MOD);
+        } else if (__sync_sub_and_fetch(&scheduler->active, 1) == 0) {
+            exit(0); // all simulations are over
+        }
+    }
+}
+
+/**
+ * Stats thread: dumps every simulation's stats each time SIGUSR1 arrives.
+ *      Counts being updated by workers meanwhile may be off by one.
+ * args should be a Scheduler *.
+ */
+void *run_stats(void *args) {
+    Scheduler *scheduler = (Scheduler *)args;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    while (true) {
+        int signal;
+        if (sigwait(&signals, &signal) != 0) {
+            continue;
+        }
+        for (int i = 0; i < scheduler->numSimulations; i++) {
+            dump_stats(scheduler->simulations[i]);
+        }
+    }
 }
 
 int main(int argc, char **argv) {
@@ -400,26 +944,70 @@ int main(int argc, char **argv) {
     }
 
     // check sinister file
-    char *sinisterFilename = argv[3];
     FILE *sinister = fopen(argv[3], "r");
     Game *game = new_game();
     if (sinister == NULL) {
         exit_game(EXIT_OPEN_FILE);
     }
-    if (read_sinister_file(game, sinister) != 0) {
+    if (load_sinister_file(game, sinister) != 0) {
         exit_game(EXIT_FILE_CONTENTS);
     }
+    size_t payloadSize;
+    char *payload = build_sinister_payload(game, sinister, &payloadSize);
+    fclose(sinister);
 
-    // run each simulation in its own thread
+    // stats go wherever STATS_ENV says, otherwise only on SIGUSR1
+    char *statsPath = getenv(STATS_ENV);
+    FILE *statsOutput = stderr;
+    if (statsPath != NULL && strcmp(statsPath, "-") != 0) {
+        statsOutput = fopen(statsPath, "a");
+        if (statsOutput == NULL) {
+            exit_game(EXIT_SYSTEM);
+        }
+    }
+
+    // set up each simulation, all sharing the same sinister data
+    Scheduler *scheduler = malloc(sizeof(Scheduler));
+    scheduler->fdSimulations = epoll_create1(0);
+    scheduler->active = (argc - 4) / 3;
+    scheduler->simulations = malloc(sizeof(Simulation *) * scheduler->active);
+    scheduler->numSimulations = 0;
+    if (scheduler->fdSimulations < 0) {
+        exit_game(EXIT_SYSTEM);
+    }
     for (int i = 4; i < argc; i += 3) {
         Simulation *simulation = malloc(sizeof(Simulation));
         simulation->height = height;
         simulation->width = width;
-        simulation->sinFilename = sinisterFilename;
+        simulation->sinPayload = payload;
+        simulation->sinPayloadSize = payloadSize;
+        simulation->game = game;
         setup_simulation(simulation, argv[i], argv[i + 1], argv[i + 2]);
-        pthread_t simRunner;
-        pthread_create(&simRunner, NULL, run_simulation, (void *)simulation);
-        pthread_detach(simRunner);
+        new_stats(simulation, scheduler->numSimulations, statsOutput,
+                statsPath != NULL);
+        scheduler->simulations[scheduler->numSimulations++] = simulation;
+        start_simulation(simulation);
+        schedule_simulation(scheduler, simulation, EPOLL_CTL_ADD);
     } 
+
+    // only the stats thread takes SIGUSR1, so block it before any others
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t stats;
+    pthread_create(&stats, NULL, run_stats, (void *)scheduler);
+    pthread_detach(stats);
+
+    // run them all on one worker per core
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1) {
+        workers = 1;
+    }
+    for (long i = 0; i < workers; i++) {
+        pthread_t worker;
+        pthread_create(&worker, NULL, run_worker, (void *)scheduler);
+        pthread_detach(worker);
+    }
     pthread_exit(0);
 }
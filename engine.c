@@ -0,0 +1,294 @@
+#include "shared.h"
+#include <stdlib.h>
+
+#define MIN_DIMENSION 1
+
+// All error exit codes
+enum ExitCodes {
+    EXIT_ARGS = 1,
+    EXIT_INVALID_HEIGHT = 2,
+    EXIT_INVALID_WIDTH = 3,
+    EXIT_OPEN_FILE = 4,
+    EXIT_FILE_CONTENTS = 5,
+    EXIT_INVALID_ROUNDS = 6,
+    EXIT_OPEN_TEAM_FILE = 7,
+    EXIT_TEAM_FILE_CONTENTS = 8,
+    EXIT_WRITE_OUTPUT = 9,
+    EXIT_SAME_TEAM_FILE = 10
+};
+
+// A team's narratives for the round so far, printed in order once it is over.
+// The simulation keeps one for each team, at the team's index in sim->teams.
+typedef struct SimOutbox {
+    char **narratives;
+    int numNarratives;
+    int capacity;
+} SimOutbox;
+
+/**
+ * Exits the program with the given status and corresponding error message
+ */
+void exit_sim(int status) {
+    char *message;
+    switch (status) {
+        case EXIT_ARGS:
+            message = "Usage: 2310sim height width sinisterfile rounds outdir "
+                    "teamfile teamfile [teamfile ...]";
+            break;
+        case EXIT_INVALID_HEIGHT:
+            message = "Invalid height";
+            break;
+        case EXIT_INVALID_WIDTH:
+            message = "Invalid width";
+            break;
+        case EXIT_OPEN_FILE:
+            message = "Unable to access sinister file";
+            break;
+        case EXIT_FILE_CONTENTS:
+            message = "Error reading sinister file";
+            break;
+        case EXIT_INVALID_ROUNDS:
+            message = "Invalid number of rounds";
+            break;
+        case EXIT_OPEN_TEAM_FILE:
+            message = "Unable to access team file";
+            break;
+        case EXIT_TEAM_FILE_CONTENTS:
+            message = "Error reading team file";
+            break;
+        case EXIT_WRITE_OUTPUT:
+            message = "Unable to write output file";
+            break;
+        case EXIT_SAME_TEAM_FILE:
+            message = "Team files must have different names";
+            break;
+        default:
+            message = "Well, this is awkward";
+    }
+    fprintf(stderr, "%s\n", message);
+    exit(status);
+}
+
+/**
+ * Returns the team described in the given team file, placed on the
+ *      simulation's grid, printing to a file of the same name (with ".out"
+ *      added) in outdir. outputs holds the names of the files already taken.
+ * Exits with team file errors if the file is invalid, with same team file if
+ *      another team file of the same name (from any directory) has been
+ *      loaded, or with output error if the output file can't be created.
+ */
+Team *load_team(Simulation *sim, char *filename, char *outdir, 
+        SymbolTable *outputs) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        exit_sim(EXIT_OPEN_TEAM_FILE);
+    }
+    if (read_team_file(sim->game, file) != 0) {
+        exit_sim(EXIT_TEAM_FILE_CONTENTS);
+    }
+    fclose(file);
+    Team *team = sim->game->team;
+    team->pos->x = team->pos->x % sim->width;
+    team->pos->y = team->pos->y % sim->height;
+
+    char *base = strrchr(filename, '/');
+    base = base == NULL ? filename : base + 1;
+    if (lookup_symbol(outputs, base) >= 0) {
+        exit_sim(EXIT_SAME_TEAM_FILE); // its output would overwrite theirs
+    }
+    add_symbol(outputs, base, outputs->count);
+    char *path = malloc(sizeof(char) * (strlen(outdir) + strlen(base) +
+            strlen("/.out") + 1));
+    sprintf(path, "%s/%s.out", outdir, base);
+    team->write = fopen(path, "w");
+    if (team->write == NULL) {
+        exit_sim(EXIT_WRITE_OUTPUT);
+    }
+    free(path);
+    return team;
+}
+
+/**
+ * Returns the outbox of the given team, found by its name since sim->teams
+ *      is sorted by name. Teams may share a name, so the team itself is then
+ *      looked for among those that do.
+ */
+SimOutbox *find_outbox(Simulation *sim, SimOutbox *outboxes, Team *team) {
+    int low = 0;
+    int high = sim->numTeams;
+    while (low < high) {
+        // the first team not named before team is in [low, high]
+        int middle = low + (high - low) / 2;
+        if (strcmp(sim->teams[middle]->name, team->name) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    while (sim->teams[low] != team) {
+        low++;
+    }
+    return &outboxes[low];
+}
+
+/**
+ * Gives the outbox a narrative of the battle against opposing: the battle
+ *      itself (as played out by play_battle()) between the opening line and
+ *      who was eliminated.
+ */
+void add_narrative(SimOutbox *outbox, Team *opposing, char *battle, 
+        Team *loser) {
+    Narrative narrative;
+    init_narrative(&narrative);
+    append_string(&narrative, "%s has a difference of opinion\n",
+            opposing->name);
+    append_string(&narrative, "%s", battle);
+    append_string(&narrative, "Team %s was eliminated.\n", loser->name);
+
+    if (outbox->numNarratives == outbox->capacity) {
+        outbox->capacity = outbox->capacity == 0 ? 1 : outbox->capacity * 2;
+        outbox->narratives = realloc(outbox->narratives, sizeof(char *) *
+                outbox->capacity);
+    }
+    outbox->narratives[outbox->numNarratives++] = narrative.text;
+}
+
+/**
+ * Plays out the battle between challenger and waiter, and gives each of them
+ *      its narrative.
+ */
+void fight(Simulation *sim, SimOutbox *outboxes, Team *challenger, 
+        Team *waiter) {
+    Narrative battle;
+    size_t start;
+    init_narrative(&battle);
+    Team *loser = play_battle(sim->game, &battle, challenger, waiter, &start);
+    add_narrative(find_outbox(sim, outboxes, challenger), waiter, battle.text,
+            loser);
+    add_narrative(find_outbox(sim, outboxes, waiter), challenger, battle.text,
+            loser);
+    free(battle.text);
+}
+
+/**
+ * Fights every battle in the zone, in the same pairings the controller
+ *      would ask for: the last team in the zone challenges everyone else, and
+ *      each other team challenges the teams between it and the last.
+ */
+void fight_zone(Simulation *sim, SimOutbox *outboxes, GroupedTeams *group) {
+    int last = group->numTeams - 1;
+    for (int j = 0; j < group->numTeams; j++) {
+        fprintf(group->teams[j]->write, "Team is in zone %d %d\n",
+                group->teams[j]->pos->x, group->teams[j]->pos->y);
+    }
+    for (int j = 0; j < last; j++) {
+        for (int k = j + 1; k < last; k++) {
+            fight(sim, outboxes, group->teams[j], group->teams[k]);
+        }
+        fight(sim, outboxes, group->teams[last], group->teams[j]);
+    }
+}
+
+/**
+ * For qsorting narratives into lexicographical order
+ */
+int sort_narratives(const void *a, const void *b) {
+    return strcmp(*((char **)a), *((char **)b));
+}
+
+/**
+ * Prints the narratives in the team's outbox for the round in lexicographical
+ *      order, as the team would, and frees them.
+ */
+void print_narratives(Team *team, SimOutbox *outbox) {
+    qsort(outbox->narratives, outbox->numNarratives, sizeof(char *),
+            sort_narratives);
+    for (int i = 0; i < outbox->numNarratives; i++) {
+        fputs(outbox->narratives[i], team->write);
+        free(outbox->narratives[i]);
+    }
+    outbox->numNarratives = 0;
+}
+
+/**
+ * Runs every round of the simulation: each round the teams in each zone
+ *      battle, then every team makes its next move. outboxes has one outbox
+ *      for each of sim->teams.
+ */
+void run_simulation(Simulation *sim, SimOutbox *outboxes) {
+    for (sim->round = 0; sim->round < sim->rounds; sim->round++) {
+        int numZones;
+        GroupedTeams *zones = get_grouped_teams(sim, &numZones);
+        for (int i = 0; i < numZones; i++) {
+            fight_zone(sim, outboxes, &zones[i]);
+        }
+        for (int i = 0; i < sim->numTeams; i++) {
+            print_narratives(sim->teams[i], &outboxes[i]);
+        }
+        if (sim->round == sim->rounds - 1) {
+            break; // nowhere left to go
+        }
+        for (int i = 0; i < sim->numTeams; i++) {
+            Team *team = sim->teams[i];
+            move_team(sim, team, team->nextMove->direction);
+            team->nextMove = team->nextMove->next;
+        }
+    }
+}
+
+/**
+ * Runs a whole simulation in this process, as 2310controller and a 2310team
+ *      per team file would, without any sockets. Each team's output goes to
+ *      its own file in outdir.
+ */
+int main(int argc, char **argv) {
+    if (argc < 8) {
+        exit_sim(EXIT_ARGS);
+    }
+    Simulation *sim = malloc(sizeof(Simulation));
+    sim->height = number(argv[1]);
+    sim->width = number(argv[2]);
+    if (sim->height < MIN_DIMENSION) {
+        exit_sim(EXIT_INVALID_HEIGHT);
+    } else if (sim->width < MIN_DIMENSION) {
+        exit_sim(EXIT_INVALID_WIDTH);
+    }
+
+    FILE *sinister = fopen(argv[3], "r");
+    if (sinister == NULL) {
+        exit_sim(EXIT_OPEN_FILE);
+    }
+    sim->game = new_game();
+    if (load_sinister_file(sim->game, sinister) != 0) {
+        exit_sim(EXIT_FILE_CONTENTS);
+    }
+    fclose(sinister);
+
+    sim->rounds = number(argv[4]);
+    if (sim->rounds <= 0) {
+        exit_sim(EXIT_INVALID_ROUNDS);
+    }
+    sim->numTeams = argc - 6;
+    sim->teams = malloc(sizeof(Team *) * sim->numTeams);
+    SymbolTable outputs;
+    init_symbols(&outputs);
+    for (int i = 0; i < sim->numTeams; i++) {
+        sim->teams[i] = load_team(sim, argv[i + 6], argv[5], &outputs);
+    }
+    qsort(sim->teams, sim->numTeams, sizeof(Team *), sort_teams);
+    new_zones(sim);
+
+    SimOutbox *outboxes = malloc(sizeof(SimOutbox) * sim->numTeams);
+    for (int i = 0; i < sim->numTeams; i++) {
+        outboxes[i].narratives = NULL;
+        outboxes[i].numNarratives = 0;
+        outboxes[i].capacity = 0;
+    }
+    run_simulation(sim, outboxes);
+    for (int i = 0; i < sim->numTeams; i++) {
+        if (fclose(sim->teams[i]->write) != 0) {
+            exit_sim(EXIT_WRITE_OUTPUT);
+        }
+    }
+    return 0;
+}
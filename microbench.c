@@ -0,0 +1,376 @@
+#include "shared.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BUDGET 200000 // operations (or entities parsed) per measurement
+#define MAX_TYPES 1000 // the effectiveness matrix is square in types
+
+// All error exit codes
+enum ExitCodes {
+    EXIT_ARGS = 1,
+    EXIT_BAD_SINISTER = 2,
+    EXIT_SYSTEM = 3
+};
+
+// A generated sinister file, and pieces of it to feed each primitive
+typedef struct {
+    int entities; // attacks, and agents; types are a tenth of that
+    char *text;
+    size_t size;
+    char *filename; // the text, written to a file for load_sinister_file()
+    char **lines; // section separators included
+    int numLines;
+    int numTokens; // across all lines
+    char **numbers; // one per entity
+    char **coords; // "x y", one per entity
+    Game *game; // the file, parsed
+} Sample;
+
+// Results are summed into this so that nothing is optimised away
+volatile long sink;
+
+/**
+ * Exits the program with the given status and corresponding error message
+ */
+void exit_microbench(int status) {
+    char *message;
+    switch (status) {
+        case EXIT_ARGS:
+            message = "Usage: 2310microbench [entities ...]";
+            break;
+        case EXIT_BAD_SINISTER:
+            message = "Generated sinister file was rejected";
+            break;
+        case EXIT_SYSTEM:
+            message = "System error";
+            break;
+        default:
+            message = "Well, this is awkward";
+    }
+    fprintf(stderr, "%s\n", message);
+    exit(status);
+}
+
+/**
+ * Returns a valid sinister file with the given number of attacks and agents,
+ *      and a tenth as many types (at least one), setting size to its length.
+ *      Each type beats the next and loses to the one after.
+ */
+char *generate_sinister(int entities, size_t *size) {
+    char *text = NULL;
+    FILE *stream = open_memstream(&text, size);
+    int numTypes = entities / 10 + 1;
+    if (numTypes > MAX_TYPES) {
+        numTypes = MAX_TYPES;
+    }
+    fprintf(stream, "# %d entities\n", entities);
+    for (int i = 0; i < numTypes; i++) {
+        fprintf(stream, "type%d\n", i);
+    }
+    fprintf(stream, ".\n");
+    for (int i = 0; i < numTypes; i++) {
+        fprintf(stream, "type%d high%d normal%d low%d\n", i, i, i, i);
+    }
+    fprintf(stream, ".\n");
+    for (int i = 0; i < numTypes; i++) {
+        fprintf(stream, "type%d", i);
+        if (numTypes > 2) {
+            fprintf(stream, " +type%d -type%d", (i + 1) % numTypes,
+                    (i + 2) % numTypes);
+        }
+        fprintf(stream, "\n");
+    }
+    fprintf(stream, ".\n");
+    for (int i = 0; i < entities; i++) {
+        fprintf(stream, "attack%d type%d\n", i, i % numTypes);
+    }
+    fprintf(stream, ".\n");
+    for (int i = 0; i < entities; i++) {
+        fprintf(stream, "agent%d type%d attack%d attack%d attack%d\n", i,
+                i % numTypes, i, (i + 1) % entities, (i + 2) % entities);
+    }
+    fprintf(stream, ".\n");
+    fclose(stream);
+    return text;
+}
+
+/**
+ * Returns a sample of the given size, with its sinister file generated,
+ *      split up and parsed.
+ * Exits if the generated file can't be written or isn't accepted.
+ */
+Sample *new_sample(int entities) {
+    Sample *sample = malloc(sizeof(Sample));
+    sample->entities = entities;
+    sample->text = generate_sinister(entities, &sample->size);
+
+    sample->filename = strdup("/tmp/2310microbench.XXXXXX");
+    int fd = mkstemp(sample->filename);
+    if (fd < 0 || write_all(fd, sample->text, sample->size) != 0) {
+        exit_microbench(EXIT_SYSTEM);
+    }
+    close(fd);
+
+    // split into lines, counting tokens
+    sample->lines = NULL;
+    sample->numLines = 0;
+    sample->numTokens = 0;
+    char *copy = strdup(sample->text);
+    for (char *line = strtok(copy, "\n"); line != NULL;
+            line = strtok(NULL, "\n")) {
+        sample->lines = realloc(sample->lines, sizeof(char *) *
+                (sample->numLines + 1));
+        sample->lines[sample->numLines++] = line;
+        for (char *c = line; *c != '\0'; c++) {
+            sample->numTokens += *c == ' ';
+        }
+        sample->numTokens++;
+    }
+
+    sample->numbers = malloc(sizeof(char *) * entities);
+    sample->coords = malloc(sizeof(char *) * entities);
+    for (int i = 0; i < entities; i++) {
+        sample->numbers[i] = malloc(sizeof(char) * BUFFER);
+        sprintf(sample->numbers[i], "%d", i * 7919);
+        sample->coords[i] = malloc(sizeof(char) * BUFFER);
+        sprintf(sample->coords[i], "%d %d", i, entities - i);
+    }
+
+    FILE *file = fmemopen(sample->text, sample->size, "r");
+    sample->game = new_game();
+    if (read_sinister_file(sample->game, file) != 0) {
+        exit_microbench(EXIT_BAD_SINISTER);
+    }
+    fclose(file);
+    return sample;
+}
+
+/**
+ * Returns how many times to repeat something that does count operations, so
+ *      that each measurement does about BUDGET of them.
+ */
+int repeats(int count) {
+    return count >= BUDGET ? 1 : BUDGET / count;
+}
+
+/**
+ * Prints one result as a CSV row: the primitive, sample size, operations
+ *      timed, total time and time per operation.
+ */
+void report(const char *name, Sample *sample, long operations,
+        double elapsed) {
+    printf("%s,%d,%ld,%.3f,%.1f\n", name, sample->entities, operations,
+            elapsed, elapsed * 1000000.0 / operations);
+}
+
+/**
+ * Times read_sinister_file() parsing the whole sample from memory.
+ */
+void bench_read_sinister_file(Sample *sample) {
+    int n = repeats(sample->entities);
+    double start = now_ms();
+    for (int i = 0; i < n; i++) {
+        FILE *file = fmemopen(sample->text, sample->size, "r");
+        Game *game = new_game();
+        if (read_sinister_file(game, file) != 0) {
+            exit_microbench(EXIT_BAD_SINISTER);
+        }
+        sink += game->numAgents;
+        fclose(file);
+        free_game(game);
+    }
+    report("read_sinister_file", sample, n, now_ms() - start);
+}
+
+/**
+ * Times load_sinister_file() parsing the whole sample from its file.
+ */
+void bench_load_sinister_file(Sample *sample) {
+    int n = repeats(sample->entities);
+    double start = now_ms();
+    for (int i = 0; i < n; i++) {
+        FILE *file = fopen(sample->filename, "r");
+        Game *game = new_game();
+        if (file == NULL || load_sinister_file(game, file) != 0) {
+            exit_microbench(EXIT_BAD_SINISTER);
+        }
+        sink += game->numAgents;
+        fclose(file);
+        free_game(game);
+    }
+    report("load_sinister_file", sample, n, now_ms() - start);
+}
+
+/**
+ * Times read_line() reading every line of the sample.
+ */
+void bench_read_line(Sample *sample) {
+    int n = repeats(sample->numLines);
+    char *line = malloc(sizeof(char) * BUFFER);
+    double start = now_ms();
+    for (int i = 0; i < n; i++) {
+        FILE *file = fmemopen(sample->text, sample->size, "r");
+        for (int j = 0; j < sample->numLines; j++) {
+            line = read_line(line, BUFFER, file);
+            sink += line[0];
+        }
+        fclose(file);
+    }
+    report("read_line", sample, (long)n * sample->numLines, now_ms() - start);
+    free(line);
+}
+
+/**
+ * Times get_token() taking the first token off every line of the sample.
+ */
+void bench_get_token(Sample *sample) {
+    int n = repeats(sample->numLines);
+    double start = now_ms();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < sample->numLines; j++) {
+            char *token = get_token(sample->lines[j], ' ');
+            sink += token[0];
+            free(token);
+        }
+    }
+    report("get_token", sample, (long)n * sample->numLines, now_ms() - start);
+}
+
+/**
+ * Times get_token_update_pos() walking every token of every line.
+ */
+void bench_get_token_update_pos(Sample *sample) {
+    int n = repeats(sample->numTokens);
+    double start = now_ms();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < sample->numLines; j++) {
+            int pos = 0;
+            char *token;
+            while ((token = get_token_update_pos(sample->lines[j], ' ',
+                    &pos)) != NULL) {
+                sink += token[0];
+                free(token);
+            }
+        }
+    }
+    report("get_token_update_pos", sample, (long)n * sample->numTokens,
+            now_ms() - start);
+}
+
+/**
+ * Times number() on one number per entity.
+ */
+void bench_number(Sample *sample) {
+    int n = repeats(sample->entities);
+    double start = now_ms();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < sample->entities; j++) {
+            sink += number(sample->numbers[j]);
+        }
+    }
+    report("number", sample, (long)n * sample->entities, now_ms() - start);
+}
+
+/**
+ * Times get_coords() on one "x y" pair per entity.
+ */
+void bench_get_coords(Sample *sample) {
+    int n = repeats(sample->entities);
+    double start = now_ms();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < sample->entities; j++) {
+            int pos = 0;
+            Coords *coords = get_coords(sample->coords[j], '\0', &pos);
+            sink += coords->x + coords->y;
+            free(coords);
+        }
+    }
+    report("get_coords", sample, (long)n * sample->entities,
+            now_ms() - start);
+}
+
+/**
+ * Times looking up every type, attack and agent in the sample by name.
+ */
+void bench_lookups(Sample *sample) {
+    Game *game = sample->game;
+    int n = repeats(game->numTypes);
+    double start = now_ms();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < game->numTypes; j++) {
+            sink += get_type(game, game->types[j]->name)->id;
+        }
+    }
+    report("get_type", sample, (long)n * game->numTypes, now_ms() - start);
+
+    n = repeats(game->numAttacks);
+    start = now_ms();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < game->numAttacks; j++) {
+            sink += get_attack(game, game->attacks[j]->name)->id;
+        }
+    }
+    report("get_attack", sample, (long)n * game->numAttacks,
+            now_ms() - start);
+
+    n = repeats(game->numAgents);
+    start = now_ms();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < game->numAgents; j++) {
+            sink += get_agent(game, game->agents[j]->name)->id;
+        }
+    }
+    report("get_agent", sample, (long)n * game->numAgents, now_ms() - start);
+}
+
+/**
+ * Frees the sample and removes its file.
+ */
+void free_sample(Sample *sample) {
+    unlink(sample->filename);
+    free(sample->filename);
+    free(sample->lines[0]); // the copy every line points into
+    free(sample->lines);
+    for (int i = 0; i < sample->entities; i++) {
+        free(sample->numbers[i]);
+        free(sample->coords[i]);
+    }
+    free(sample->numbers);
+    free(sample->coords);
+    free(sample->text);
+    free_game(sample->game);
+    free(sample);
+}
+
+/**
+ * Times shared.c's parsing and lookup primitives over generated sinister
+ *      files of each given size (10 to 100000 entities by default), printing
+ *      the results as CSV.
+ */
+int main(int argc, char **argv) {
+    int defaults[] = {10, 100, 1000, 10000, 100000};
+    int numSizes = argc > 1 ? argc - 1 : sizeof(defaults) / sizeof(int);
+    int *sizes = argc > 1 ? malloc(sizeof(int) * numSizes) : defaults;
+    for (int i = 1; i < argc; i++) {
+        sizes[i - 1] = number(argv[i]);
+        if (sizes[i - 1] <= 0) {
+            exit_microbench(EXIT_ARGS);
+        }
+    }
+
+    printf("benchmark,entities,operations,total_ms,ns_per_op\n");
+    for (int i = 0; i < numSizes; i++) {
+        Sample *sample = new_sample(sizes[i]);
+        bench_read_sinister_file(sample);
+        bench_load_sinister_file(sample);
+        bench_read_line(sample);
+        bench_get_token(sample);
+        bench_get_token_update_pos(sample);
+        bench_number(sample);
+        bench_get_coords(sample);
+        bench_lookups(sample);
+        free_sample(sample);
+        fflush(stdout);
+    }
+    return 0;
+}
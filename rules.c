@@ -0,0 +1,228 @@
+#include "shared.h"
+#include <stdlib.h>
+#include <stdarg.h>
+
+/**
+ * Starts the given narrative off as an empty string.
+ */
+void init_narrative(Narrative *narrative) {
+    narrative->capacity = NARRATIVE_SIZE;
+    narrative->text = malloc(sizeof(char) * narrative->capacity);
+    narrative->text[0] = '\0';
+    narrative->length = 0;
+    narrative->muted = false;
+}
+
+/**
+ * Appends the format string to the narrative, replacing underscores with 
+ *      spaces and increasing space for the narrative if necessary.
+ * The string is formatted straight onto the end of the narrative, which
+ *      doubles in size whenever it runs out of room.
+ */
+void append_string(Narrative *narrative, const char *format, ...) {
+    va_list args;
+    if (narrative->muted) {
+        return;
+    }
+    while (true) {
+        size_t space = narrative->capacity - narrative->length;
+        va_start(args, format);
+        int n = vsnprintf(narrative->text + narrative->length, space, format,
+                args);
+        va_end(args);
+        if (n < space) {
+            // formatted string fit, so replace underscores in what was added
+            char *added = narrative->text + narrative->length;
+            for (int i = 0; i < n; i++) {
+                if (added[i] == '_') {
+                    added[i] = ' ';
+                }
+            }
+            narrative->length += n;
+            return;
+        }
+        while (narrative->capacity - narrative->length <= n) {
+            narrative->capacity *= 2;
+        }
+        narrative->text = realloc(narrative->text, sizeof(char) * 
+                narrative->capacity);
+    }
+}
+
+/**
+ * Applies attacker's attack to defender and adds it to the narrative.
+ */
+void narrate_attack(Narrative *narrative, Game *game, Member *attacker,
+        Attack *attack, Member *defender) {
+    int effectiveness = get_effectiveness(game, attack, defender->agent);
+    defender->health -= effectiveness;
+    append_string(narrative, "%s uses %s: %s", attacker->agent->name,
+            attack->name, attack->type->effectiveness[effectiveness - 1]);
+    if (defender->health <= 0) {
+        append_string(narrative, " - %s was eliminated.",
+                defender->agent->name);
+    }
+    append_string(narrative, "\n");
+}
+
+/**
+ * Returns a copy of the team's member at index i, ready to be sent out: at
+ *      full health and starting its attack rotation from the top.
+ */
+Member fresh_member(Team *team, int i) {
+    Member member = *team->members[i];
+    member.health = MAX_HEALTH;
+    member.nextAttack = 0;
+    return member;
+}
+
+/**
+ * Plays out a whole battle between the two teams' members, adding it to the
+ *      narrative exactly as either team would tell it after exchanging
+ *      attacks. The first team chooses and attacks first; after that whoever
+ *      was attacked goes next, sending out a new member first if theirs was
+ *      eliminated. Sets start to where the narrative stops depending on who
+ *      is telling it (after both first members are chosen).
+ * Returns the losing team.
+ */
+Team *play_battle(Game *game, Narrative *narrative, Team *first, 
+        Team *second, size_t *start) {
+    Team *sides[2] = {first, second};
+    Member current[2];
+    int index[2] = {0, 0};
+    for (int s = 0; s < 2; s++) {
+        current[s] = fresh_member(sides[s], 0);
+        append_string(narrative, "%s chooses %s\n", sides[s]->name,
+                current[s].agent->name);
+    }
+
+    *start = narrative->length;
+    int attacker = 0;
+    while (true) {
+        int defender = 1 - attacker;
+        Member *member = &current[attacker];
+        Attack *attack = game->attacks[member->attacks[member->nextAttack]];
+        member->nextAttack = (member->nextAttack + 1) % member->numAttacks;
+        narrate_attack(narrative, game, member, attack, &current[defender]);
+        if (current[defender].health <= 0) {
+            if (++index[defender] == MAX_TEAM_PLAYERS) {
+                return sides[defender];
+            }
+            current[defender] = fresh_member(sides[defender], 
+                    index[defender]);
+            append_string(narrative, "%s chooses %s\n", 
+                    sides[defender]->name, current[defender].agent->name);
+        }
+        attacker = defender;
+    }
+}
+
+/**
+ * For qsorting teams alphabetically by name
+ */
+int sort_teams(const void *a, const void *b) {
+    return strcmp((*((Team **)a))->name, (*((Team **)b))->name);
+}
+
+/**
+ * Allocates the simulation's zone index. Must be called once numTeams is known.
+ */
+void new_zones(Simulation *sim) {
+    Zones *zones = malloc(sizeof(Zones));
+    zones->capacity = 1;
+    while (zones->capacity < sim->numTeams * 2) {
+        zones->capacity *= 2;
+    }
+    zones->slots = malloc(sizeof(int) * zones->capacity);
+    zones->groups = malloc(sizeof(GroupedTeams) * sim->numTeams);
+    zones->coords = malloc(sizeof(Coords) * sim->numTeams);
+    zones->members = malloc(sizeof(Team *) * sim->numTeams);
+    zones->zoneOf = malloc(sizeof(int) * sim->numTeams);
+    sim->zones = zones;
+}
+
+/**
+ * Returns the index of the zone at the team's position, adding a new empty
+ *      zone if it is the first team there.
+ */
+int find_zone(Zones *zones, Team *team) {
+    unsigned int mask = zones->capacity - 1;
+    unsigned int i = ((unsigned int)team->pos->x * 73856093u ^
+            (unsigned int)team->pos->y * 19349663u) & mask;
+    while (zones->slots[i] != -1) {
+        Coords *coords = &zones->coords[zones->slots[i]];
+        if (coords->x == team->pos->x && coords->y == team->pos->y) {
+            return zones->slots[i];
+        }
+        i = (i + 1) & mask; // linear probing
+    }
+    int zone = zones->numZones++;
+    zones->slots[i] = zone;
+    zones->coords[zone] = *team->pos;
+    zones->groups[zone].numTeams = 0;
+    return zone;
+}
+
+/**
+ * Returns a list of grouped teams by zone. Populates numZones with the number
+ *      of zones containing a team. Groups are in order of their first team,
+ *      and keep teams in sorted order. Linear in the number of teams.
+ * The groups are owned by sim and are valid until the next call.
+ */
+GroupedTeams *get_grouped_teams(Simulation *sim, int *numZones) {
+    Zones *zones = sim->zones;
+    memset(zones->slots, -1, sizeof(int) * zones->capacity);
+    zones->numZones = 0;
+
+    // find each team's zone and count the teams in each
+    for (int i = 0; i < sim->numTeams; i++) {
+        int zone = find_zone(zones, sim->teams[i]);
+        zones->groups[zone].numTeams++;
+        zones->zoneOf[i] = zone;
+    }
+    // give each zone its slice of members, then place teams in order
+    int offset = 0;
+    for (int i = 0; i < zones->numZones; i++) {
+        zones->groups[i].teams = &zones->members[offset];
+        offset += zones->groups[i].numTeams;
+        zones->groups[i].numTeams = 0;
+    }
+    for (int i = 0; i < sim->numTeams; i++) {
+        GroupedTeams *group = &zones->groups[zones->zoneOf[i]];
+        group->teams[group->numTeams++] = sim->teams[i];
+    }
+    *numZones = zones->numZones;
+    return zones->groups;
+}
+
+/**
+ * Moves the team one zone in the given direction (N, E, S or W), wrapping
+ *      around the edges of the simulation's grid.
+ * Returns false if the direction is invalid.
+ */
+bool move_team(Simulation *sim, Team *team, char direction) {
+    switch (direction) {
+        case 'N':
+            team->pos->y += 1;
+            break;
+        case 'E':
+            team->pos->x += 1;
+            break;
+        case 'S':
+            team->pos->y -= 1;
+            break;
+        case 'W':
+            team->pos->x -= 1;
+            break;
+        default:
+            return false;
+    }
+    if (team->pos->x < 0) {
+        team->pos->x = sim->width - 1;
+    } else if (team->pos->y < 0) {
+        team->pos->y = sim->height - 1;
+    }
+    team->pos->x = team->pos->x % sim->width;
+    team->pos->y = team->pos->y % sim->height;
+    return true;
+}
@@ -3,6 +3,9 @@
 #include <signal.h>
 #include <ctype.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 /**
  * Reads a section of a sinister file. 
@@ -15,7 +18,7 @@
 int read_section(Game *game, FILE *file, int (*processLine)(Game *, char *)) {
     while (true) {
         char *line = malloc(sizeof(char) * 80);
-        read_line(line, 80, file);
+        line = read_line(line, 80, file);
         if (line == NULL || strlen(line) == 0) {
             return -1; // unexpected EOF or blank line
         } else if (strcmp(line, ".") == 0) {
@@ -64,6 +67,37 @@ Type *new_type(char *name) {
     return type;
 }
 
+/**
+ * Adds the type to the game data, giving it the next type ID.
+ */
+void add_type(Game *game, Type *type) {
+    game->types = realloc(game->types, sizeof(Type *) * ++game->numTypes);
+    type->id = game->numTypes - 1;
+    game->types[type->id] = type;
+    add_symbol(&game->typeSymbols, type->name, type->id);
+}
+
+/**
+ * Adds the attack to the game data, giving it the next attack ID.
+ */
+void add_attack(Game *game, Attack *attack) {
+    game->attacks = realloc(game->attacks, sizeof(Attack *) * 
+            ++game->numAttacks);
+    attack->id = game->numAttacks - 1;
+    game->attacks[attack->id] = attack;
+    add_symbol(&game->attackSymbols, attack->name, attack->id);
+}
+
+/**
+ * Adds the agent to the game data, giving it the next agent ID.
+ */
+void add_agent(Game *game, Agent *agent) {
+    game->agents = realloc(game->agents, sizeof(Agent *) * ++game->numAgents);
+    agent->id = game->numAgents - 1;
+    game->agents[agent->id] = agent;
+    add_symbol(&game->agentSymbols, agent->name, agent->id);
+}
+
 /** 
  * Returns first part of message up to the given delimiter.
  * Returns the full message if no delimiter found.
@@ -102,10 +136,7 @@ int read_type_name(Game *game, char *line) {
     }
     free(token);
 
-    // add to game data
-    game->numTypes++;
-    game->types = realloc(game->types, sizeof(Type *) * game->numTypes);
-    game->types[game->numTypes - 1] = new_type(name);
+    add_type(game, new_type(name));
     return 0;
 }
 
@@ -231,9 +262,7 @@ int read_attack(Game *game, char *line) {
     }
     free(typeName);
 
-    game->attacks = realloc(game->attacks, sizeof(Attack *) * 
-            ++game->numAttacks);
-    game->attacks[game->numAttacks - 1] = attack;
+    add_attack(game, attack);
     return 0;
 }
 
@@ -270,34 +299,183 @@ int read_agent(Game *game, char *line) {
         if (attack == NULL) {
             return -1; // invalid attack
         }
-        agent->legalAttacks[i] = attack;
+        agent->legalAttacks[i] = attack->id;
     }
 
     if (line[strlen(line) - 1] == ' ' || pos < strlen(line)) {
         return -1;
     }
-    // add agent to game data
-    game->agents = realloc(game->agents, sizeof(Agent *) * ++game->numAgents);
-    game->agents[game->numAgents - 1] = agent;
+    add_agent(game, agent);
     return 0;
 }
 
+/**
+ * Initialises an empty symbol table
+ */
+void init_symbols(SymbolTable *table) {
+    table->capacity = 16;
+    table->count = 0;
+    table->slots = calloc(table->capacity, sizeof(Symbol));
+}
+
+/**
+ * FNV-1a hash of the given name
+ */
+unsigned int hash_name(const char *name, int length) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Returns the slot holding the first length chars of name, or the empty slot
+ *      it would go in.
+ */
+Symbol *find_slot(SymbolTable *table, const char *name, int length) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int i = hash_name(name, length) & mask;
+    while (table->slots[i].name != NULL && 
+            (strncmp(table->slots[i].name, name, length) != 0 ||
+            table->slots[i].name[length] != '\0')) {
+        i = (i + 1) & mask; // linear probing
+    }
+    return &table->slots[i];
+}
+
+/**
+ * Returns the ID interned under the given name, -1 if not found.
+ */
+int lookup_symbol(SymbolTable *table, const char *name) {
+    return lookup_symbol_length(table, name, strlen(name));
+}
+
+/**
+ * Returns the ID interned under the first length chars of name (which need
+ *      not be null terminated), -1 if not found.
+ */
+int lookup_symbol_length(SymbolTable *table, const char *name, int length) {
+    Symbol *slot = find_slot(table, name, length);
+    return slot->name == NULL ? -1 : slot->id;
+}
+
+/**
+ * Interns name with the given ID. The name is not copied.
+ * If name is already present, the original ID is kept.
+ */
+void add_symbol(SymbolTable *table, char *name, int id) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        // keep load factor at most a half; rehash into a bigger table
+        Symbol *old = table->slots;
+        int oldCapacity = table->capacity;
+        table->capacity *= 2;
+        table->slots = calloc(table->capacity, sizeof(Symbol));
+        for (int i = 0; i < oldCapacity; i++) {
+            if (old[i].name != NULL) {
+                *find_slot(table, old[i].name, strlen(old[i].name)) = old[i];
+            }
+        }
+        free(old);
+    }
+    Symbol *slot = find_slot(table, name, strlen(name));
+    if (slot->name == NULL) {
+        slot->name = name;
+        slot->id = id;
+        table->count++;
+    }
+}
+
 /**
  * Returns a new game
  */
 Game *new_game(void) {
     Game *game = malloc(sizeof(Game));
     game->types = NULL;
+    game->effectiveness = NULL;
     game->agents = NULL;
     game->attacks = NULL;
     game->numTypes = 0;
     game->numAgents = 0;
     game->numAttacks = 0;
-    game->numNarratives = 0;
-    sem_init(&game->narrativeLock, 0, 1);
+    game->narratives = NULL;
+    game->compiled = false;
+    game->peers = NULL;
+    game->results = NULL;
+    game->stats = NULL;
+    game->binary = false;
+    game->localBattles = false;
+    init_symbols(&game->typeSymbols);
+    init_symbols(&game->attackSymbols);
+    init_symbols(&game->agentSymbols);
     return game;
 }
 
+/**
+ * Frees the game and all of its sinister data. Only for games read from a
+ *      sinister text file, since compiled images are freed with their mapping.
+ */
+void free_game(Game *game) {
+    for (int i = 0; i < game->numTypes; i++) {
+        Type *type = game->types[i];
+        free(type->name);
+        for (int j = 0; j < 3; j++) {
+            free(type->effectiveness[j]);
+        }
+        free(type->lower);
+        free(type->higher);
+        free(type);
+    }
+    for (int i = 0; i < game->numAttacks; i++) {
+        free(game->attacks[i]->name);
+        free(game->attacks[i]);
+    }
+    for (int i = 0; i < game->numAgents; i++) {
+        free(game->agents[i]->name);
+        free(game->agents[i]);
+    }
+    free(game->types);
+    free(game->attacks);
+    free(game->agents);
+    free(game->effectiveness);
+    free(game->typeSymbols.slots);
+    free(game->attackSymbols.slots);
+    free(game->agentSymbols.slots);
+    free(game);
+}
+
+/**
+ * Fills game->effectiveness so that any attack type vs defending type lookup
+ *      is a single array access. A type listed as both lower and higher than
+ *      another is treated as lower, as the relations are checked in that order.
+ */
+void build_effectiveness_matrix(Game *game) {
+    int n = game->numTypes;
+    game->effectiveness = malloc(sizeof(char) * n * n);
+    memset(game->effectiveness, NORMAL, sizeof(char) * n * n);
+    for (int i = 0; i < n; i++) {
+        Type *type = game->types[i];
+        char *row = &game->effectiveness[type->id * n];
+        for (int j = 0; j < type->numHigher; j++) {
+            row[type->higher[j]->id] = HIGH;
+        }
+        for (int j = 0; j < type->numLower; j++) {
+            row[type->lower[j]->id] = LOW;
+        }
+    }
+}
+
+/**
+ * Returns the effectiveness of the attack against the opponent.
+ * Assumes attack and opponent are valid, and the sinister file has been read.
+ */
+enum Effectiveness get_effectiveness(Game *game, Attack *attack, 
+        Agent *opponent) {
+    return game->effectiveness[attack->type->id * game->numTypes + 
+            opponent->type->id];
+}
+
 /**
  * Reads sinister file and populates the given game struct.
  * Returns non-zero if an error occurred.
@@ -311,6 +489,15 @@ int read_sinister_file(Game *game, FILE *file) {
             read_section(game, file, read_agent)) {
         return -1;
     }
+    return finish_sinister_file(game);
+}
+
+/**
+ * Checks the fully parsed sinister data is complete, then builds the
+ *      effectiveness matrix.
+ * Returns non-zero if the data is incomplete.
+ */
+int finish_sinister_file(Game *game) {
     // check we have some data for each category
     if (game->numTypes <= 0 || game->numAgents <= 0 || game->numAttacks <= 0) {
         return -1;
@@ -322,6 +509,7 @@ int read_sinister_file(Game *game, FILE *file) {
             return -1;
         }
     }
+    build_effectiveness_matrix(game);
     return 0;
 }
 
@@ -329,12 +517,8 @@ int read_sinister_file(Game *game, FILE *file) {
  * Returns the type with the given typename, null if it doesn't exist.
  */
 Type *get_type(Game *game, char *typeName) {
-    for (int i = 0; i < game->numTypes; i++) {
-        if (strcmp(game->types[i]->name, typeName) == 0) {
-            return game->types[i];
-        }
-    }
-    return NULL;
+    int id = lookup_symbol(&game->typeSymbols, typeName);
+    return id < 0 ? NULL : game->types[id];
 }
 
 /** 
@@ -363,24 +547,16 @@ bool valid_port(int port) {
  * Returns the attack with the given name, NULL if not found
  */
 Attack *get_attack(Game *game, char *name) {
-    for (int i = 0; i < game->numAttacks; i++) {
-        if (strcmp(game->attacks[i]->name, name) == 0) {
-            return game->attacks[i];
-        }
-    }
-    return NULL;
+    int id = lookup_symbol(&game->attackSymbols, name);
+    return id < 0 ? NULL : game->attacks[id];
 }
 
 /**
  * Returns the agent with the given name, NULL if not found
  */
 Agent *get_agent(Game *game, char *name) {
-    for (int i = 0; i < game->numAgents; i++) {
-        if (strcmp(game->agents[i]->name, name) == 0) {
-            return game->agents[i];
-        }
-    }
-    return NULL;
+    int id = lookup_symbol(&game->agentSymbols, name);
+    return id < 0 ? NULL : game->agents[id];
 }
 
 /**
@@ -388,7 +564,7 @@ Agent *get_agent(Game *game, char *name) {
  */
 bool legal_attack(Agent *agent, Attack *attack) {
     for (int i = 0; i < LEGAL_ATTACKS; i++) {
-        if (strcmp(agent->legalAttacks[i]->name, attack->name) == 0) {
+        if (agent->legalAttacks[i] == attack->id) {
             return true;
         }
     }
@@ -417,12 +593,31 @@ int accept_connection(int fdServer, FILE **read, FILE **write) {
     return fd;
 }
 
+/**
+ * Writes all size bytes of data to fd, retrying on short writes.
+ * Returns non-zero if the write failed.
+ */
+int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
 /**
  * Populates result with a line from the file, reallocing if necessary.
  * Leaves off newline character.
  * result must be malloc'd to buffer size prior to using this function.
+ * Returns result, which may have moved if it was realloc'd.
  */
-void read_line(char *result, int buffer, FILE *file) {
+char *read_line(char *result, int buffer, FILE *file) {
     int c;
     int position = 0;
     while ((c = fgetc(file)) != '\n' && c != EOF) {
@@ -432,10 +627,11 @@ void read_line(char *result, int buffer, FILE *file) {
             result = realloc(result, buffer);
         }
     }
-    if (result[position - 1] == '\n') {
+    if (position > 0 && result[position - 1] == '\n') {
         result[position - 1] = '\0'; // remove newline
     }
     result[position] = '\0';
+    return result;
 }
 
 /**
@@ -490,6 +686,7 @@ Team *new_team(char *name) {
     team->name = name;
     team->port = 0;
     team->nextMove = NULL;
+    team->binary = false;
     return team;
 }
 
@@ -500,3 +697,312 @@ void ignore_sigpipe(void) {
     sa.sa_flags = SA_RESTART;
     sigaction(SIGPIPE, &sa, 0);
 }
+
+/**
+ * Stores value in the given number of bytes at data, big endian.
+ */
+void put_number(unsigned char *data, unsigned int value, int size) {
+    for (int i = size - 1; i >= 0; i--) {
+        data[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+/**
+ * Returns the big endian number stored in the given number of bytes at data.
+ */
+unsigned int get_number(const unsigned char *data, int size) {
+    unsigned int value = 0;
+    for (int i = 0; i < size; i++) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+/**
+ * Writes a binary frame with the given opcode and payload to file. Does not 
+ *      flush.
+ */
+void write_frame(FILE *file, int opcode, const unsigned char *payload, 
+        int size) {
+    unsigned char header[FRAME_HEADER];
+    header[0] = opcode;
+    put_number(&header[1], size, 2);
+    fwrite(header, 1, FRAME_HEADER, file);
+    fwrite(payload, 1, size, file);
+}
+
+/**
+ * Returns the size of the binary frame at the start of data (which holds 
+ *      length bytes), or 0 if it has not all arrived yet.
+ */
+int frame_size(const char *data, int length) {
+    if (length < FRAME_HEADER) {
+        return 0;
+    }
+    int size = FRAME_HEADER + get_number((unsigned char *)&data[1], 2);
+    return size <= length ? size : 0;
+}
+
+/**
+ * Reads a binary frame from file into payload, which must have room for
+ *      MAX_PAYLOAD bytes, setting size to the payload's length.
+ * Returns the frame's opcode, or -1 if EOF is found first.
+ */
+int read_frame(FILE *file, unsigned char *payload, int *size) {
+    unsigned char header[FRAME_HEADER];
+    if (fread(header, 1, FRAME_HEADER, file) != FRAME_HEADER) {
+        return -1;
+    }
+    *size = get_number(&header[1], 2);
+    if (fread(payload, 1, *size, file) != *size) {
+        return -1;
+    }
+    return header[0];
+}
+
+/**
+ * Populates member's attacks with attacks given in the line.
+ * Attacks should be space-separated with no leading or trailing space.
+ * Returns non-zero if attacks invalid.
+ */
+int read_team_attacks(char *line, Game *game, Member *member) {
+    int pos = 0;
+    if (pos >= strlen(line)) {
+        return -1; // no attacks
+    }
+
+    // read attacks until we have reached the end of the line
+    member->attacks = NULL;
+    member->numAttacks = 0;
+    while (pos < strlen(line)) {
+        // get attack
+        char *attackName = get_token_update_pos(line, ' ', &pos);
+        Attack *attack = get_attack(game, attackName);
+        free(attackName);
+        if (attack == NULL) {
+            return -1; // invalid attack
+        } else if (!legal_attack(member->agent, attack)) {
+            return -1; // not legal attack
+        }
+
+        // add attack to the end of member's rotation
+        member->attacks = realloc(member->attacks, sizeof(int) * 
+                ++member->numAttacks);
+        member->attacks[member->numAttacks - 1] = attack->id;
+    }
+    member->nextAttack = 0;
+    return 0;
+}
+
+/**
+ * Reads the agents and their attacks from the given team file, and populates
+ *      game->team with this information.
+ * Returns non-zero if bad format or inconsistent with sinister file.
+ */
+int read_agents(FILE *file, Game *game) {
+    for (int i = 0; i < MAX_TEAM_PLAYERS; i++) {
+        char *line = malloc(sizeof(char) * BUFFER);
+        line = read_line(line, BUFFER, file);
+        if (line == NULL || strlen(line) == 0) {
+            return -1; // empty line or EOF
+        }
+
+        // Set up agent
+        char *agentName = get_token(line, ' ');
+        Agent *agent = get_agent(game, agentName);
+        free(agentName);
+        if (agent == NULL) {
+            return -1; // invalid agent
+        }
+
+        // add member and their attacks to team members
+        Member *member = malloc(sizeof(Member));
+        game->team->members[i] = member;
+        member->agent = agent;
+        int pos = strlen(agent->name) + 1;
+        if (read_team_attacks(&line[pos], game, member) != 0) {
+            return -1;
+        }
+        free(line);
+    }
+    return 0;
+}
+
+/**
+ * Reads a line of directions from the given file, and adds these to team data.
+ * Returns non-zero if invalid characters or format, or no directions.
+ */
+int read_directions(FILE *file, Team *team) {
+    int c;
+    Direction *tail;
+    while ((c = fgetc(file)) != EOF) {
+        // look for letter
+        if (c == 'N' || c == 'S' || c == 'E' || c == 'W') {
+            Direction *d = malloc(sizeof(Direction));
+            d->direction = c;
+            d->next = NULL;
+            if (team->nextMove == NULL) {
+                team->nextMove = d;
+            } else {
+                tail->next = d;
+            }
+            tail = d;
+        } else {
+            return -1; // invalid char
+        }
+
+        // look for space
+        c = fgetc(file);
+        if (c != ' ' && c != EOF && c != '\n') {
+            return -1; // unexpected char (not space)
+        }
+    }
+    if (team->nextMove == NULL) {
+        return -1; // nowhere to go
+    }
+
+    // make directions circularly linked
+    tail->next = team->nextMove;
+    return 0;
+}
+
+/**
+ * Populates game->team with the team described in the given team file.
+ * Returns non-zero if the file is invalid or inconsistent with the sinister 
+ *      file.
+ */
+int read_team_file(Game *game, FILE *file) {
+    // read teamname, agents, attacks
+    char *name = malloc(sizeof(char) * BUFFER);
+    name = read_line(name, BUFFER, file);
+    if (name == NULL || strlen(name) == 0) {
+        return -1;
+    }
+    game->team = new_team(name);
+    if (read_agents(file, game) != 0) {
+        return -1;
+    }
+
+    // get coords
+    char coords[BUFFER];
+    if (fgets(coords, BUFFER, file) == NULL) {
+        return -1; // unexpected EOF
+    }
+    int pos = 0;
+    game->team->pos = get_coords(coords, '\n', &pos);
+    if (game->team->pos->x < 0 || game->team->pos->y < 0) {
+        return -1; // invalid coords
+    }
+
+    // get directions
+    if (read_directions(file, game->team) != 0) {
+        return -1;
+    }
+    if (fgetc(file) != EOF) { 
+        return -1; // too much file
+    }
+    return 0;
+}
+
+/**
+ * Returns the monotonic clock's current time in milliseconds.
+ */
+double now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/**
+ * Starts the histogram off with no samples.
+ */
+void init_histogram(Histogram *histogram) {
+    memset(histogram, 0, sizeof(Histogram));
+}
+
+/**
+ * Adds a latency (in milliseconds) to the histogram. Thread-safe without
+ *      locking.
+ */
+void record_latency(Histogram *histogram, double ms) {
+    unsigned long micros = ms > 0 ? (unsigned long)(ms * 1000) : 0;
+    int bucket = micros;
+    if (micros >= HISTOGRAM_STEPS) {
+        // which power of two, then which step within it
+        int octave = 63 - __builtin_clzl(micros);
+        int step = (micros >> (octave - 3)) & (HISTOGRAM_STEPS - 1);
+        bucket = octave >= HISTOGRAM_OCTAVES ? HISTOGRAM_BUCKETS - 1 :
+                (octave - 2) * HISTOGRAM_STEPS + step;
+    }
+    __atomic_fetch_add(&histogram->counts[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->samples, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->totalMicros, micros, __ATOMIC_RELAXED);
+    unsigned long max = __atomic_load_n(&histogram->maxMicros, 
+            __ATOMIC_RELAXED);
+    while (micros > max && !__atomic_compare_exchange_n(
+            &histogram->maxMicros, &max, micros, true, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED)) {
+        // someone else changed the max; max now has theirs
+    }
+}
+
+/**
+ * Returns the upper bound (in microseconds) of the given histogram bucket.
+ */
+unsigned long bucket_bound(int bucket) {
+    if (bucket < HISTOGRAM_STEPS) {
+        return bucket + 1;
+    }
+    int octave = bucket / HISTOGRAM_STEPS + 2;
+    int step = bucket % HISTOGRAM_STEPS;
+    return (1ul << octave) + (step + 1) * (1ul << (octave - 3));
+}
+
+/**
+ * Returns the upper bound (in milliseconds) of the bucket holding the given
+ *      percentile (nearest rank) of the histogram's samples, or the largest
+ *      sample if that is smaller.
+ */
+double histogram_percentile(Histogram *histogram, unsigned long samples,
+        double percent) {
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += histogram->counts[i];
+        if (seen * 100.0 >= samples * percent) {
+            unsigned long bound = bucket_bound(i);
+            return (bound < histogram->maxMicros ? bound :
+                    histogram->maxMicros) / 1000.0;
+        }
+    }
+    return histogram->maxMicros / 1000.0;
+}
+
+/**
+ * Prints the histogram on one line: how many samples, their mean, p50, p99
+ *      and max (ms; percentiles are bucket bounds), then the count in each
+ *      non-empty bucket by its upper bound in microseconds.
+ */
+void print_histogram(FILE *file, const char *name, Histogram *histogram) {
+    unsigned long samples = histogram->samples;
+    fprintf(file, "%s: n %lu", name, samples);
+    if (samples == 0) {
+        fprintf(file, "\n");
+        return;
+    }
+    fprintf(file, " mean %.3f p50 %.3f p99 %.3f max %.3f ms |",
+            histogram->totalMicros / 1000.0 / samples,
+            histogram_percentile(histogram, samples, 50),
+            histogram_percentile(histogram, samples, 99),
+            histogram->maxMicros / 1000.0);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->counts[i] == 0) {
+            continue;
+        } else if (i == HISTOGRAM_BUCKETS - 1) {
+            fprintf(file, " more %lu", histogram->counts[i]);
+        } else {
+            fprintf(file, " <%lu %lu", bucket_bound(i), histogram->counts[i]);
+        }
+    }
+    fprintf(file, "\n");
+}
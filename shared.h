@@ -11,6 +11,29 @@
 #define MAX_HEALTH 10
 #define MAX_PORT_NUMBER 65535
 #define BUFFER 80 // pretty arbitrarily chosen buffer size
+#define SINISTER_MAGIC "SIN2310" // first bytes of a compiled sinister image
+#define SINISTER_VERSION 1
+#define BINARY_OFFER "binary" // follows "sinister" or "iwannaplay" if spoken
+#define FRAME_HEADER 3 // opcode byte, then payload length (2 bytes)
+#define MAX_PAYLOAD 65535
+
+// Opcodes of the binary protocol. Each frame is its opcode, its payload
+// length, then the payload, with numbers big endian. Every opcode is below
+// ' ', so the first byte on a connection tells frames and text apart.
+enum Opcodes {
+    OP_FIGHTMEIRL = 1, // team name
+    OP_HAVEATYOU, // team name
+    OP_ISELECTYOU, // agent ID (2 bytes)
+    OP_ATTACK, // agent ID, attack ID (2 bytes each)
+    OP_BATTLE, // x, y (4 bytes each), then per team port (2), binary flag (1)
+    OP_WHERENOW,
+    OP_GAMEOVERMAN,
+    OP_DONEFIGHTING,
+    OP_DISCO,
+    OP_TRAVEL, // direction (1 byte)
+    OP_LINEUP, // per member: agent ID, number of attacks, attack IDs (2 each)
+    OP_VERDICT // digest of a locally worked out battle (4 bytes)
+};
 
 enum Effectiveness {
     HIGH = 3,
@@ -20,6 +43,7 @@ enum Effectiveness {
 
 typedef struct Type {
     char *name;
+    int id; // index into game->types and the effectiveness matrix
     char *effectiveness[3]; // {low, med, high}
     struct Type **lower; // types that this type is lower than
     struct Type **higher; // the types that this type is higher than
@@ -29,15 +53,10 @@ typedef struct Type {
 
 typedef struct {
     char *name;
+    int id; // index into game->attacks
     Type *type;
 } Attack;
 
-// circularly linked attack list node
-typedef struct AttackNode {
-    Attack *attack;
-    struct AttackNode *next;
-} AttackNode;
-
 // circularly linked direction list node
 typedef struct Direction {
     char direction; // N, E, S, W
@@ -46,15 +65,17 @@ typedef struct Direction {
 
 typedef struct {
     char *name;
+    int id; // index into game->agents
     Type *type;  
-    Attack *legalAttacks[LEGAL_ATTACKS]; // list of legal attacks 
+    int legalAttacks[LEGAL_ATTACKS]; // IDs of legal attacks
 } Agent;
 
 // A Team Member
 typedef struct {
     Agent *agent;
-    AttackNode *nextAttack; // circularly linked
-    AttackNode *firstAttack;
+    int *attacks; // attack IDs in rotation order
+    int numAttacks;
+    int nextAttack; // index into attacks
     int health;
 } Member;
 
@@ -71,23 +92,71 @@ typedef struct {
     Direction *nextMove;
     FILE *read; // read from this team
     FILE *write; // write to this team
+    bool binary; // messages to and from this team are binary frames
+    struct Inbox *inbox; // controller's buffered input from this team
 } Team;
 
+// An interned name and the dense ID it maps to
+typedef struct {
+    char *name; // NULL if slot is empty
+    int id;
+} Symbol;
+
+// Open addressing hash map from names to dense IDs
+typedef struct {
+    Symbol *slots;
+    int capacity; // always a power of two
+    int count;
+} SymbolTable;
+
+// Initial space for a battle's narrative, enough for most battles
+#define NARRATIVE_SIZE 1024
+
+// A string built up over a battle, with room to grow
+typedef struct {
+    char *text;
+    size_t length;
+    size_t capacity;
+    bool muted; // if set, appending does nothing
+} Narrative;
+
+// Latencies in microseconds, counted without locking. Under 8us each has its
+// own bucket; above that each power of two is split into 8 buckets, so a
+// bucket is never more than an eighth wider than its lower bound. The last
+// bucket counts everything from 2^HISTOGRAM_OCTAVES us (about 16s) up.
+#define HISTOGRAM_STEPS 8
+#define HISTOGRAM_OCTAVES 24
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_OCTAVES - 2) * HISTOGRAM_STEPS + 1)
+typedef struct {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long samples;
+    unsigned long totalMicros;
+    unsigned long maxMicros;
+} Histogram;
+
 // Holds all the sinsiter file data and game information
 typedef struct Game {
     Team *team;
     Type **types;
     int numTypes;
+    char *effectiveness; // numTypes x numTypes, [attackType][defendingType]
     Agent **agents;
     int numAgents;
     Attack **attacks;
     int numAttacks;
-    char **narratives;
-    int numNarratives;
-    sem_t narrativeLock; // for adding to narratives array
+    SymbolTable typeSymbols;
+    SymbolTable attackSymbols;
+    SymbolTable agentSymbols;
+    bool compiled; // true if sinister data came from a compiled image
+    struct NarrativeNode *narratives; // finished battles, newest first
     bool simulation; // true if in simulation mode
+    bool binary; // messages to and from the controller are binary frames
+    bool localBattles; // work out battles from lineups where we can
     FILE *read; // read from controller
     FILE *write; // write to controller
+    struct Peers *peers; // open connections to teams we have challenged
+    struct BattleCache *results; // every distinct battle's result so far
+    struct TeamStats *stats; // how long battles, messages and connects take
 } Game; 
 
 // used for the purpose of passing game-related arguments to a thread
@@ -96,6 +165,7 @@ typedef struct {
     Team *opposing;
     bool simulation;
     int port;
+    bool binary; // the team on port speaks binary frames
 } ThreadGame;
 
 // Used in controller to hold all of one simulation's info
@@ -106,32 +176,115 @@ typedef struct {
     int width;
     int height;
     int fdServer;
-    char *sinFilename;
+    int fdEvents; // epoll instance watching every team's socket
+    struct Zones *zones; // which teams share each zone this round
+    struct Stats *stats; // how long each phase and team takes
+    int connected; // teams accepted so far
+    int admitted; // teams whose "iwannaplay" has been accepted
+    int round;
+    int phase; // enum Phases in controller.c
+    char *sinPayload; // "sinister" message, shared between simulations
+    size_t sinPayloadSize;
+    Game *game; // parsed sinister data
 } Simulation; 
 
+// List of teams and number of teams. Used for grouping teams in same zone.
+typedef struct {
+    Team **teams;
+    int numTeams;
+} GroupedTeams;
+
+// Occupancy index from (x, y) to the group of teams in that zone. Storage is
+// sized for the simulation's teams once, and the index is rebuilt each round.
+typedef struct Zones {
+    int capacity; // hash slots; a power of two at least twice numTeams
+    int *slots; // index into groups, -1 if empty
+    GroupedTeams *groups; // in order of each zone's first team
+    Coords *coords; // position of each zone
+    int numZones;
+    Team **members; // all teams, grouped contiguously
+    int *zoneOf; // zone index of each team in sim->teams
+} Zones;
+
 // setup
 void ignore_sigpipe(void);
 int read_sinister_file(Game *game, FILE *file);
+int read_team_attacks(char *line, Game *game, Member *member);
+int read_agents(FILE *file, Game *game);
+int read_directions(FILE *file, Team *team);
+int read_team_file(Game *game, FILE *file);
+int finish_sinister_file(Game *game);
+Type *new_type(char *name);
+Attack *new_attack(char *name);
 Agent *new_agent(char *name);
+void add_type(Game *game, Type *type);
+void add_attack(Game *game, Attack *attack);
+void add_agent(Game *game, Agent *agent);
 Team *new_team(char *name);
 Game *new_game(void);
+void free_game(Game *game);
 
 // map stuff
+unsigned int hash_name(const char *name, int length);
+void init_symbols(SymbolTable *table);
+int lookup_symbol(SymbolTable *table, const char *name);
+int lookup_symbol_length(SymbolTable *table, const char *name, int length);
+void add_symbol(SymbolTable *table, char *name, int id);
 Agent *get_agent(Game *game, char *name);
 Type *get_type(Game *game, char *name);
 Attack *get_attack(Game *game, char *name);
 bool legal_attack(Agent *agent, Attack *attack);
+enum Effectiveness get_effectiveness(Game *game, Attack *attack,
+        Agent *opponent);
+
+// memory mapped and compiled sinister files (sinister.c)
+int load_sinister_file(Game *game, FILE *file);
+int map_sinister_file(Game *game, const char *data, long size, long *used);
+int load_sinister_image(Game *game, char *data, long size);
+int write_sinister_image(Game *game, FILE *file);
+void write_sinister_text(Game *game, FILE *file);
+
+// battles and the grid, the same for every program (rules.c)
+void init_narrative(Narrative *narrative);
+void append_string(Narrative *narrative, const char *format, ...);
+void narrate_attack(Narrative *narrative, Game *game, Member *attacker,
+        Attack *attack, Member *defender);
+Member fresh_member(Team *team, int i);
+Team *play_battle(Game *game, Narrative *narrative, Team *first, 
+        Team *second, size_t *start);
+int sort_teams(const void *a, const void *b);
+void new_zones(Simulation *sim);
+int find_zone(Zones *zones, Team *team);
+GroupedTeams *get_grouped_teams(Simulation *sim, int *numZones);
+bool move_team(Simulation *sim, Team *team, char direction);
 
 // networking shizzle
 int open_listen(int *port);
 int accept_connection(int fdServer, FILE **read, FILE **write);
 bool valid_port(int port);
+int write_all(int fd, const char *data, size_t size);
+
+// binary protocol frames
+void put_number(unsigned char *data, unsigned int value, int size);
+unsigned int get_number(const unsigned char *data, int size);
+void write_frame(FILE *file, int opcode, const unsigned char *payload, 
+        int size);
+int frame_size(const char *data, int length);
+int read_frame(FILE *file, unsigned char *payload, int *size);
+
+// timing
+double now_ms(void);
+void init_histogram(Histogram *histogram);
+void record_latency(Histogram *histogram, double ms);
+double histogram_percentile(Histogram *histogram, unsigned long samples,
+        double percent);
+void print_histogram(FILE *file, const char *name, Histogram *histogram);
 
 // general parsing
 int number(char *string);
 char *get_token(char *message, char delimiter);
 char *get_token_update_pos(char *line, char delimiter, int *pos);
-void read_line(char *result, int buffer, FILE *file);
+char *read_line(char *result, int buffer, FILE *file);
 Coords *get_coords(char *line, char end, int *pos);
 
 #endif
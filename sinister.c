@@ -0,0 +1,580 @@
+#include "shared.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Compiled sinister images hold already validated sinister data with integer
+ * cross-references, in native byte order:
+ *      ImageHeader, ImageType[numTypes], ImageAttack[numAttacks],
+ *      ImageAgent[numAgents], effectiveness matrix (numTypes x numTypes bytes),
+ *      string pool (stringsSize bytes of null terminated strings).
+ * Name and effectiveness fields are offsets into the string pool.
+ */
+typedef struct {
+    char magic[8]; // SINISTER_MAGIC
+    uint32_t version; // SINISTER_VERSION
+    uint32_t numTypes;
+    uint32_t numAttacks;
+    uint32_t numAgents;
+    uint32_t stringsSize;
+} ImageHeader;
+
+typedef struct {
+    uint32_t name;
+    uint32_t effectiveness[3]; // {low, med, high}
+} ImageType;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+} ImageAttack;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    uint32_t legalAttacks[LEGAL_ATTACKS];
+} ImageAgent;
+
+// Growable string pool used when writing an image
+typedef struct {
+    char *data;
+    uint32_t size;
+    uint32_t capacity;
+} StringPool;
+
+/*
+ * Zero-copy sinister file parser. The file is memory mapped and tokenised in
+ * place as (pointer, length) slices; only the names and effectiveness strings
+ * that end up in the game data are copied. Accepts and rejects exactly the
+ * same files as read_sinister_file().
+ */
+
+// A piece of the mapped file. Not null terminated.
+typedef struct {
+    const char *start;
+    int length;
+} Slice;
+
+/**
+ * Returns a malloc'd, null terminated copy of the slice.
+ */
+char *copy_slice(Slice slice) {
+    char *copy = malloc(sizeof(char) * (slice.length + 1));
+    memcpy(copy, slice.start, slice.length);
+    copy[slice.length] = '\0';
+    return copy;
+}
+
+/**
+ * Returns the next line of rest (without the newline), and moves rest past
+ *      it. The line stops at a null char, as read_line()'s result would.
+ * Returns an empty line at EOF.
+ */
+Slice next_line(Slice *rest) {
+    Slice line = {rest->start, rest->length};
+    const char *newline = memchr(rest->start, '\n', rest->length);
+    if (newline != NULL) {
+        line.length = newline - rest->start;
+        rest->start = newline + 1;
+        rest->length -= line.length + 1;
+    } else {
+        rest->start += rest->length;
+        rest->length = 0;
+    }
+    const char *nul = memchr(line.start, '\0', line.length);
+    if (nul != NULL) {
+        line.length = nul - line.start;
+    }
+    return line;
+}
+
+/**
+ * Returns the part of line from pos up to the delimiter (or end of line).
+ * Updates pos to the index after the delimiter, like get_token_update_pos().
+ * pos must be within the line.
+ */
+Slice next_token(Slice line, char delimiter, int *pos) {
+    Slice token = {line.start + *pos, line.length - *pos};
+    const char *end = memchr(token.start, delimiter, token.length);
+    if (end != NULL) {
+        token.length = end - token.start;
+    }
+    *pos += token.length + 1;
+    return token;
+}
+
+/**
+ * Returns the type named by the slice, NULL if it doesn't exist.
+ */
+Type *slice_type(Game *game, Slice name) {
+    int id = lookup_symbol_length(&game->typeSymbols, name.start, 
+            name.length);
+    return id < 0 ? NULL : game->types[id];
+}
+
+/**
+ * Returns the attack named by the slice, NULL if it doesn't exist.
+ */
+Attack *slice_attack(Game *game, Slice name) {
+    int id = lookup_symbol_length(&game->attackSymbols, name.start, 
+            name.length);
+    return id < 0 ? NULL : game->attacks[id];
+}
+
+/**
+ * Returns true if the (non-empty) line ends in a space.
+ */
+bool trailing_space(Slice line) {
+    return line.start[line.length - 1] == ' ';
+}
+
+/**
+ * Mapped equivalent of read_type_name().
+ */
+int map_type_name(Game *game, Slice line) {
+    if (memchr(line.start, ' ', line.length) != NULL) {
+        return -1; // a space appeared
+    }
+    add_type(game, new_type(copy_slice(line)));
+    return 0;
+}
+
+/**
+ * Mapped equivalent of read_effectiveness_strings().
+ */
+int map_effectiveness_strings(Game *game, Slice line) {
+    int pos = 0;
+    Type *type = slice_type(game, next_token(line, ' ', &pos));
+    if (type == NULL || type->effectiveness[0] != NULL) {
+        return -1; // invalid or duplicate type
+    }
+
+    // read three effectiveness strings
+    for (int i = 2; i >= 0; i--) {
+        if (pos >= line.length) {
+            return -1; // not enough effectiveness strings
+        }
+        Slice effectiveness = next_token(line, ' ', &pos);
+        if (effectiveness.length == 0) {
+            return -1; // consecutive spaces
+        }
+        type->effectiveness[i] = copy_slice(effectiveness);
+    }
+
+    if (pos < line.length || trailing_space(line)) {
+        return -1; // too much data on line
+    }
+    return 0;
+}
+
+/**
+ * Mapped equivalent of read_relation_strings().
+ */
+int map_relation_strings(Game *game, Slice line) {
+    int pos = 0;
+    Type *type = slice_type(game, next_token(line, ' ', &pos));
+    if (type == NULL || type->numLower > 0 || type->numHigher > 0) {
+        return -1; // invalid or duplicate type
+    }
+
+    while (pos < line.length) {
+        Slice relation = next_token(line, ' ', &pos);
+        if (relation.length < 2) {
+            return -1; // didn't get at least two chars
+        }
+        Slice relatedName = {relation.start + 1, relation.length - 1};
+        Type *related = slice_type(game, relatedName);
+        if (related == NULL) {
+            return -1; // invalid type found
+        }
+        switch (relation.start[0]) {
+            case '+':
+                type->higher = realloc(type->higher, sizeof(Type *) * 
+                        ++type->numHigher);
+                type->higher[type->numHigher - 1] = related;
+                break;
+            case '-':
+                type->lower = realloc(type->lower, sizeof(Type *) * 
+                        ++type->numLower);
+                type->lower[type->numLower - 1] = related;
+                break;
+            case '=':
+                break; // don't care.
+            default:
+                return -1; // bad character
+        }
+    }
+    if (trailing_space(line)) {
+        return -1; // trailing space
+    }
+    return 0;
+}
+
+/**
+ * Mapped equivalent of read_attack().
+ */
+int map_attack(Game *game, Slice line) {
+    int pos = 0;
+    Slice attackName = next_token(line, ' ', &pos);
+    Slice typeName = {line.start + pos, 0};
+    if (pos < line.length) {
+        typeName.length = line.length - pos; // rest of the line
+    }
+    if (attackName.length == 0 || typeName.length == 0 || 
+            slice_attack(game, attackName) != NULL) {
+        return -1; // consecutive spaces, missing type or duplicate attack
+    }
+
+    Type *type = slice_type(game, typeName);
+    if (type == NULL) {
+        return -1; // invalid type
+    }
+    Attack *attack = new_attack(copy_slice(attackName));
+    attack->type = type;
+    add_attack(game, attack);
+    return 0;
+}
+
+/**
+ * Mapped equivalent of read_agent().
+ */
+int map_agent(Game *game, Slice line) {
+    // agent name
+    int pos = 0;
+    Slice name = next_token(line, ' ', &pos);
+    if (pos >= line.length || name.length == 0 || 
+            lookup_symbol_length(&game->agentSymbols, name.start, 
+            name.length) >= 0) {
+        return -1; // not enough data, consecutive spaces, or duplicate agent
+    }
+    // agent type
+    Type *type = slice_type(game, next_token(line, ' ', &pos));
+    if (type == NULL) {
+        return -1; // invalid type
+    }
+
+    // get legal attacks
+    int legalAttacks[LEGAL_ATTACKS];
+    for (int i = 0; i < LEGAL_ATTACKS; i++) {
+        if (pos >= line.length) {
+            return -1; // not enough attacks
+        }
+        Attack *attack = slice_attack(game, next_token(line, ' ', &pos));
+        if (attack == NULL) {
+            return -1; // invalid attack
+        }
+        legalAttacks[i] = attack->id;
+    }
+
+    if (trailing_space(line) || pos < line.length) {
+        return -1;
+    }
+    Agent *agent = new_agent(copy_slice(name));
+    agent->type = type;
+    memcpy(agent->legalAttacks, legalAttacks, sizeof(legalAttacks));
+    add_agent(game, agent);
+    return 0;
+}
+
+/**
+ * Mapped equivalent of read_section().
+ */
+int map_section(Game *game, Slice *rest, int (*processLine)(Game *, Slice)) {
+    while (true) {
+        Slice line = next_line(rest);
+        if (line.length == 0) {
+            return -1; // unexpected EOF or blank line
+        } else if (line.length == 1 && line.start[0] == '.') {
+            break; // end of section
+        } else if (line.start[0] == '#') {
+            continue; // ignore comments
+        }
+
+        int result;
+        if ((result = processLine(game, line)) != 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parses sinister data held in memory and populates the given game struct.
+ * used is set to the number of bytes consumed (i.e. up to and including the
+ *      newline after the agents section's terminating ".").
+ * Returns non-zero if an error occurred.
+ */
+int map_sinister_file(Game *game, const char *data, long size, long *used) {
+    Slice rest = {data, size};
+    if (map_section(game, &rest, map_type_name) ||
+            map_section(game, &rest, map_effectiveness_strings) ||
+            map_section(game, &rest, map_relation_strings) ||
+            map_section(game, &rest, map_attack) ||
+            map_section(game, &rest, map_agent)) {
+        return -1;
+    }
+    *used = rest.start - data;
+    return finish_sinister_file(game);
+}
+
+/**
+ * Returns true if offset names a null terminated string in the pool.
+ */
+bool valid_string(const char *strings, uint32_t stringsSize, uint32_t offset) {
+    return offset < stringsSize && strings[stringsSize - 1] == '\0';
+}
+
+/**
+ * Populates game from a compiled sinister image of the given size.
+ * Names and effectiveness strings point into data, which must outlive game.
+ * Returns non-zero if the image is malformed or from another version.
+ */
+int load_sinister_image(Game *game, char *data, long size) {
+    ImageHeader header;
+    if (size < sizeof(ImageHeader)) {
+        return -1;
+    }
+    memcpy(&header, data, sizeof(ImageHeader));
+    if (memcmp(header.magic, SINISTER_MAGIC, sizeof(SINISTER_MAGIC)) != 0 ||
+            header.version != SINISTER_VERSION || header.numTypes == 0 ||
+            header.numAttacks == 0 || header.numAgents == 0 ||
+            header.stringsSize == 0) {
+        return -1;
+    }
+    // check the sections account for exactly the whole image
+    uint64_t numTypes = header.numTypes;
+    uint64_t expected = sizeof(ImageHeader) + 
+            numTypes * sizeof(ImageType) + 
+            header.numAttacks * (uint64_t)sizeof(ImageAttack) +
+            header.numAgents * (uint64_t)sizeof(ImageAgent) + 
+            numTypes * numTypes + header.stringsSize;
+    if (expected != size) {
+        return -1;
+    }
+    ImageType *imageTypes = (ImageType *)(data + sizeof(ImageHeader));
+    ImageAttack *imageAttacks = (ImageAttack *)(imageTypes + numTypes);
+    ImageAgent *imageAgents = (ImageAgent *)(imageAttacks + 
+            header.numAttacks);
+    char *matrix = (char *)(imageAgents + header.numAgents);
+    char *strings = matrix + numTypes * numTypes;
+    uint32_t stringsSize = header.stringsSize;
+
+    // fix up types
+    Type *types = calloc(header.numTypes, sizeof(Type));
+    game->types = malloc(sizeof(Type *) * header.numTypes);
+    for (uint32_t i = 0; i < header.numTypes; i++) {
+        ImageType *from = &imageTypes[i];
+        for (int j = 0; j < 3; j++) {
+            if (!valid_string(strings, stringsSize, from->effectiveness[j])) {
+                return -1;
+            }
+            types[i].effectiveness[j] = strings + from->effectiveness[j];
+        }
+        if (!valid_string(strings, stringsSize, from->name)) {
+            return -1;
+        }
+        types[i].name = strings + from->name;
+        types[i].id = i;
+        game->types[i] = &types[i];
+        add_symbol(&game->typeSymbols, types[i].name, i);
+    }
+    game->numTypes = header.numTypes;
+    for (uint64_t i = 0; i < numTypes * numTypes; i++) {
+        if (matrix[i] != LOW && matrix[i] != NORMAL && matrix[i] != HIGH) {
+            return -1;
+        }
+    }
+    game->effectiveness = matrix;
+
+    // fix up attacks
+    Attack *attacks = calloc(header.numAttacks, sizeof(Attack));
+    game->attacks = malloc(sizeof(Attack *) * header.numAttacks);
+    for (uint32_t i = 0; i < header.numAttacks; i++) {
+        ImageAttack *from = &imageAttacks[i];
+        if (!valid_string(strings, stringsSize, from->name) ||
+                from->type >= header.numTypes) {
+            return -1;
+        }
+        attacks[i].name = strings + from->name;
+        attacks[i].id = i;
+        attacks[i].type = game->types[from->type];
+        game->attacks[i] = &attacks[i];
+        add_symbol(&game->attackSymbols, attacks[i].name, i);
+    }
+    game->numAttacks = header.numAttacks;
+
+    // fix up agents
+    Agent *agents = calloc(header.numAgents, sizeof(Agent));
+    game->agents = malloc(sizeof(Agent *) * header.numAgents);
+    for (uint32_t i = 0; i < header.numAgents; i++) {
+        ImageAgent *from = &imageAgents[i];
+        if (!valid_string(strings, stringsSize, from->name) ||
+                from->type >= header.numTypes) {
+            return -1;
+        }
+        for (int j = 0; j < LEGAL_ATTACKS; j++) {
+            if (from->legalAttacks[j] >= header.numAttacks) {
+                return -1;
+            }
+            agents[i].legalAttacks[j] = from->legalAttacks[j];
+        }
+        agents[i].name = strings + from->name;
+        agents[i].id = i;
+        agents[i].type = game->types[from->type];
+        game->agents[i] = &agents[i];
+        add_symbol(&game->agentSymbols, agents[i].name, i);
+    }
+    game->numAgents = header.numAgents;
+    game->compiled = true;
+    return 0;
+}
+
+/**
+ * Adds a copy of string to the pool, returning its offset.
+ */
+uint32_t pool_string(StringPool *pool, const char *string) {
+    uint32_t length = strlen(string) + 1;
+    while (pool->size + length > pool->capacity) {
+        pool->capacity = pool->capacity * 2 + BUFFER;
+        pool->data = realloc(pool->data, pool->capacity);
+    }
+    memcpy(pool->data + pool->size, string, length);
+    pool->size += length;
+    return pool->size - length;
+}
+
+/**
+ * Writes the game's sinister data to file as a compiled sinister image.
+ * Returns non-zero if writing failed.
+ */
+int write_sinister_image(Game *game, FILE *file) {
+    StringPool pool = {NULL, 0, 0};
+    ImageType *types = malloc(sizeof(ImageType) * game->numTypes);
+    ImageAttack *attacks = malloc(sizeof(ImageAttack) * game->numAttacks);
+    ImageAgent *agents = malloc(sizeof(ImageAgent) * game->numAgents);
+    for (int i = 0; i < game->numTypes; i++) {
+        types[i].name = pool_string(&pool, game->types[i]->name);
+        for (int j = 0; j < 3; j++) {
+            types[i].effectiveness[j] = pool_string(&pool, 
+                    game->types[i]->effectiveness[j]);
+        }
+    }
+    for (int i = 0; i < game->numAttacks; i++) {
+        attacks[i].name = pool_string(&pool, game->attacks[i]->name);
+        attacks[i].type = game->attacks[i]->type->id;
+    }
+    for (int i = 0; i < game->numAgents; i++) {
+        agents[i].name = pool_string(&pool, game->agents[i]->name);
+        agents[i].type = game->agents[i]->type->id;
+        for (int j = 0; j < LEGAL_ATTACKS; j++) {
+            agents[i].legalAttacks[j] = game->agents[i]->legalAttacks[j];
+        }
+    }
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(ImageHeader));
+    memcpy(header.magic, SINISTER_MAGIC, sizeof(SINISTER_MAGIC));
+    header.version = SINISTER_VERSION;
+    header.numTypes = game->numTypes;
+    header.numAttacks = game->numAttacks;
+    header.numAgents = game->numAgents;
+    header.stringsSize = pool.size;
+    int n = game->numTypes;
+    bool ok = fwrite(&header, sizeof(ImageHeader), 1, file) == 1 &&
+            fwrite(types, sizeof(ImageType), n, file) == n &&
+            fwrite(attacks, sizeof(ImageAttack), game->numAttacks, file) == 
+            game->numAttacks &&
+            fwrite(agents, sizeof(ImageAgent), game->numAgents, file) == 
+            game->numAgents &&
+            fwrite(game->effectiveness, sizeof(char), n * n, file) == n * n &&
+            fwrite(pool.data, sizeof(char), pool.size, file) == pool.size;
+    free(types);
+    free(attacks);
+    free(agents);
+    free(pool.data);
+    return ok && fflush(file) == 0 ? 0 : -1;
+}
+
+/**
+ * Writes the game's sinister data to file in sinister text format, so it can
+ *      be sent to teams regardless of how it was loaded. Relations are taken
+ *      from the effectiveness matrix.
+ */
+void write_sinister_text(Game *game, FILE *file) {
+    int n = game->numTypes;
+    for (int i = 0; i < n; i++) {
+        fprintf(file, "%s\n", game->types[i]->name);
+    }
+    fprintf(file, ".\n");
+    for (int i = 0; i < n; i++) {
+        Type *type = game->types[i];
+        fprintf(file, "%s %s %s %s\n", type->name, type->effectiveness[2],
+                type->effectiveness[1], type->effectiveness[0]);
+    }
+    fprintf(file, ".\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(file, "%s", game->types[i]->name);
+        for (int j = 0; j < n; j++) {
+            char effectiveness = game->effectiveness[i * n + j];
+            if (effectiveness != NORMAL) {
+                fprintf(file, " %c%s", effectiveness == HIGH ? '+' : '-',
+                        game->types[j]->name);
+            }
+        }
+        fprintf(file, "\n");
+    }
+    fprintf(file, ".\n");
+    for (int i = 0; i < game->numAttacks; i++) {
+        fprintf(file, "%s %s\n", game->attacks[i]->name, 
+                game->attacks[i]->type->name);
+    }
+    fprintf(file, ".\n");
+    for (int i = 0; i < game->numAgents; i++) {
+        Agent *agent = game->agents[i];
+        fprintf(file, "%s %s", agent->name, agent->type->name);
+        for (int j = 0; j < LEGAL_ATTACKS; j++) {
+            fprintf(file, " %s", game->attacks[agent->legalAttacks[j]]->name);
+        }
+        fprintf(file, "\n");
+    }
+    fprintf(file, ".\n");
+}
+
+/**
+ * Reads a sinister file or compiled sinister image and populates the given 
+ *      game struct. Regular files are memory mapped; other files (e.g.
+ *      sockets) fall back to read_sinister_file().
+ * On success the file is left positioned just after the sinister data.
+ * Returns non-zero if an error occurred.
+ */
+int load_sinister_file(Game *game, FILE *file) {
+    struct stat info;
+    long start = ftell(file);
+    if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode) || 
+            start < 0 || info.st_size <= start) {
+        return read_sinister_file(game, file);
+    }
+    char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, 
+            fileno(file), 0);
+    if (data == MAP_FAILED) {
+        return read_sinister_file(game, file);
+    }
+
+    long size = info.st_size - start;
+    if (size >= sizeof(SINISTER_MAGIC) && 
+            memcmp(data + start, SINISTER_MAGIC, sizeof(SINISTER_MAGIC)) == 0) {
+        // compiled image: game keeps pointing into the mapping
+        fseek(file, 0, SEEK_END);
+        if (start % sizeof(uint32_t) != 0) {
+            return -1; // records would be misaligned
+        }
+        return load_sinister_image(game, data + start, size);
+    }
+    long used = 0;
+    int result = map_sinister_file(game, data + start, size, &used);
+    munmap(data, info.st_size);
+    fseek(file, start + used, SEEK_SET);
+    return result;
+}
@@ -4,6 +4,13 @@
 #include <pthread.h>
 #include <netdb.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
 
 // All the things that could go wrong
 enum ExitCodes {
@@ -27,9 +34,22 @@ typedef enum TeamMessages {
     HAVEATYOU,
     ISELECTYOU,
     ATTACK,
+    LINEUP,
+    VERDICT,
     END // Used for EOF
 } TeamMsgs;
 
+// A message from another team, decoded from either a line of text or a
+// binary frame
+typedef struct {
+    TeamMsgs type;
+    char *name; // fightmeirl and haveatyou only; malloc'd
+    Agent *agent; // iselectyou and attack only
+    Attack *attack; // attack only
+    Member *lineup; // lineup only; MAX_TEAM_PLAYERS members, malloc'd
+    unsigned int digest; // verdict only
+} TeamMsg;
+
 // Messages that can be received from the controller
 typedef enum ControllerMessages {
     SINISTER,
@@ -38,90 +58,150 @@ typedef enum ControllerMessages {
     WHERENOW
 } ControllerMsgs;
 
-/**
- * Adds the given narrative to game's array of narratives. Thread-safe.
- */
-void add_narrative(Game *game, char *narrative) {
-    sem_wait(&game->narrativeLock);
-    game->numNarratives++;
-    game->narratives = realloc(game->narratives, sizeof(char *) * 
-            game->numNarratives);
-    game->narratives[game->numNarratives - 1] = narrative;
-    sem_post(&game->narrativeLock);
-}
+// A finished battle's narrative, as kept in game->narratives
+typedef struct NarrativeNode {
+    char *text;
+    struct NarrativeNode *next;
+} NarrativeNode;
+
+// Set in the environment to work out battles locally with teams that agree
+#define LOCAL_BATTLES_ENV "TEAM_LOCAL_BATTLES"
+
+// Set in the environment to a file (or "-" for stderr) to dump stats there
+// on exit. SIGUSR1 dumps them at any time.
+#define STATS_ENV "TEAM_STATS"
+
+// A finished battle's result, kept so a repeat of it needn't be worked out
+// or rendered
+typedef struct {
+    char *narrative;
+    unsigned int digest; // of the battle, if it was worked out locally
+    uint64_t *transcript; // what the opposing team sent, if exchanged
+    size_t *marks; // how long the narrative was as each of those arrived
+    int numHeard; // messages in transcript
+    int next; // index of the next record with the same key, or -1
+} BattleRecord;
+
+// The result of every distinct battle so far. A battle worked out locally is
+// keyed by who went first, the opposing team's lineup and their name. An
+// exchanged battle's lineup only arrives as it goes, so it is keyed by who
+// went first and their name, and records sharing a key are chained in the
+// order they were added, to be told apart by their transcripts.
+struct BattleCache {
+    SymbolTable keys; // to index into records
+    BattleRecord *records;
+    int numRecords;
+    sem_t lock; // for looking up and adding records
+};
 
-/**
- * Appends the format string to the narrative, replacing underscores with 
- *      spaces and increasing space for the narrative if necessary.
- */
-void append_string(char **narrative, const char *format, ...) {
-    int n, bufferSize = 40;
-    char *segment = NULL;
-    va_list args;
-    // reallocate size for format string until args fit
-    while (true) {
-        segment = realloc(segment, sizeof(char) * bufferSize);
-        va_start(args, format);
-        n = vsnprintf(segment, bufferSize, format, args);
-        va_end(args);
-        if (n < bufferSize) {
-            break; // formatted string fit into memory. All is well.
-        }
-        bufferSize = n + 1;
-    }
-    // append to narrative, replacing underscores with spaces
-    for (int i = 0; i < strlen(segment); i++) {
-        if (segment[i] == '_') {
-            segment[i] = ' ';
-        }
-    }
-    *narrative = realloc(*narrative, sizeof(char) * (strlen(*narrative) + 
-            strlen(segment) + 1));
-    strcat(*narrative, segment);
-    free(segment);
-}
+// Where a battle is up to: which message we are waiting for next
+typedef enum BattleStates {
+    AWAIT_FIGHTMEIRL, // we were challenged
+    AWAIT_HAVEATYOU, // we challenged
+    AWAIT_FIRST_OPPONENT, // their first member, before we choose ours
+    AWAIT_OPENING_OPPONENT, // their first member, after we chose ours
+    AWAIT_NEXT_OPPONENT, // their next member, after we eliminated one
+    AWAIT_ATTACK,
+    AWAIT_VERDICT, // their digest of the battle we both worked out locally
+    BATTLE_OVER
+} BattleState;
+
+// A battle in progress against one opposing team. Resumable: each message
+// from the opposing team is fed in with step_battle().
+typedef struct Battle {
+    Game *game;
+    Team *opposing;
+    Team *loser;
+    Narrative narrative;
+    bool goFirst; // true if we attack first
+    BattleState state;
+    int i; // index of our team's current agent
+    int j; // index of opposing team's current agent
+    Member *member; // our current member
+    Member *opponent; // their current member
+    Member *lineup; // their lineup, if they offered to work it out locally
+    unsigned int digest; // of the battle, if worked out locally
+    uint64_t *transcript; // what the opposing team has sent, if exchanged
+    size_t *marks; // how long the narrative was as each of those arrived
+    int heard; // messages in transcript
+    int room; // for messages in transcript and marks
+    bool replaying; // true if this battle's result is already cached
+    BattleRecord cached; // the cached result, if replaying
+    double start; // when we challenged, or they did (0 until then)
+} Battle;
+
+// A team that has challenged us, as seen by wait mode's event loop
+typedef struct {
+    Battle *battle;
+    int fd;
+    char *input; // received but not yet processed
+    int length;
+    int capacity;
+    int consumed; // how much of input has been processed
+    int battles; // battles finished over this connection
+} Challenger;
+
+// A connection to a team we have challenged, kept open for rematches
+typedef struct {
+    int port;
+    Team *opposing;
+} Peer;
+
+// All of our peer connections, plus where to find localhost
+struct Peers {
+    Peer *peers;
+    int numPeers;
+    struct in_addr localhost;
+    sem_t lock; // for looking up and adding peers
+};
+
+// How long things take, updated by every thread without locking
+struct TeamStats {
+    Histogram battles; // from the first message to the narrative
+    Histogram waits; // for each message read_team_msg() reads
+    Histogram connects; // to the controller and to the teams we challenge
+    int running; // challenge threads right now
+    int peak; // the most challenge threads at once
+    int started; // challenge threads ever
+    FILE *output;
+    bool dumpAtEnd;
+};
 
 /**
- * Returns the effectiveness of the attack against the opponent.
- * Assumes attack and opponent are valid.
+ * Adds the given narrative to game's list of narratives. Thread-safe without
+ *      locking: the narrative is pushed onto the front of the list.
  */
-enum Effectiveness get_effectiveness(Attack *attack, Agent *opponent) {
-    for (int i = 0; i < attack->type->numLower; i++) {
-        if (strcmp(attack->type->lower[i]->name, opponent->type->name) == 0) {
-            return LOW;
-        }
-    }
-    for (int i = 0; i < attack->type->numHigher; i++) {
-        if (strcmp(attack->type->higher[i]->name, opponent->type->name) == 0) {
-            return HIGH;
-        }
+void add_narrative(Game *game, char *narrative) {
+    NarrativeNode *node = malloc(sizeof(NarrativeNode));
+    node->text = narrative;
+    node->next = __atomic_load_n(&game->narratives, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&game->narratives, &node->next, node,
+            true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // someone else added theirs first; node->next now has the new head
     }
-    return NORMAL;
 }
 
 /**
- * Send member's attack on opponent to the write stream, and add to narrative.
+ * Queue member's attack on opponent on the write stream, and add to narrative.
  * Increments the member's attack
  */
-void attack(char **narrative, Game *game, FILE *write, Member *member, 
+void attack(Narrative *narrative, Game *game, Team *opposing, Member *member, 
         Member *opponent) {
     // message opposing team
-    Attack *attack = member->nextAttack->attack;
-    fprintf(write, "attack %s %s\n", member->agent->name, attack->name);
-    fflush(write);
-
-    // get effectiveness and update narrative
-    int effectiveness = get_effectiveness(attack, opponent->agent);
-    opponent->health -= effectiveness;
-    append_string(narrative, "%s uses %s: %s", member->agent->name,
-            attack->name, attack->type->effectiveness[effectiveness - 1]);
-    if (opponent->health <= 0) {
-        append_string(narrative, " - %s was eliminated.",
-                opponent->agent->name);
-    }
-    append_string(narrative, "\n");
+    Attack *attack = game->attacks[member->attacks[member->nextAttack]];
+    if (opposing->binary) {
+        unsigned char payload[4];
+        put_number(&payload[0], member->agent->id, 2);
+        put_number(&payload[2], attack->id, 2);
+        write_frame(opposing->write, OP_ATTACK, payload, 4);
+    } else {
+        fprintf(opposing->write, "attack %s %s\n", member->agent->name, 
+                attack->name);
+    }
+
+    narrate_attack(narrative, game, member, attack, opponent);
     // increment attack
-    member->nextAttack = member->nextAttack->next;
+    member->nextAttack = (member->nextAttack + 1) % member->numAttacks;
 }
 
 /**
@@ -180,12 +260,12 @@ void exit_game(int status) {
  * length is line's initial size. line is reallocated space if needed.
  * Exits with controller disconnected or protocol error if invalid message.
  */
-ControllerMsgs read_controller_msg(char *line, int length, FILE *file) {
-    read_line(line, length, file);
-    if (strlen(line) == 0) {
+ControllerMsgs read_controller_msg(char **line, int length, FILE *file) {
+    *line = read_line(*line, length, file);
+    if (strlen(*line) == 0) {
         exit_game(EXIT_CONTROLLER_DISCO);   
     }
-    char *type = get_token(line, ' ');
+    char *type = get_token(*line, ' ');
     ControllerMsgs result = -1;
     if (strcmp(type, "sinister") == 0) {
         result = SINISTER;
@@ -202,62 +282,186 @@ ControllerMsgs read_controller_msg(char *line, int length, FILE *file) {
     return result;
 }
 
-/** 
- * Populates line with the next line read from file, up to the given length.
+/**
+ * Decodes the given line of text from another team into msg.
  * Exits with protocol error if invalid message.
- * Calling thread exits if EOF is found (Sends "disco" to controller first if
- *      we're in simulation mode)
- */
-TeamMsgs read_team_msg(char *line, int length, FILE *file, Game *game) {
-    read_line(line, length, file);
-    if (strlen(line) == 0) {
-        if (game->simulation) {
-            fprintf(game->write, "disco\n"); // team disconnected in sim mode
-            fflush(game->write);
-            pthread_exit(0);
-        } else {
-            exit_game(EXIT_TEAM_DISCO); // team disconnected in 1v1 mode
-        }
-    }
+ */
+void parse_team_msg(Game *game, char *line, TeamMsg *msg) {
     char *type = get_token(line, ' ');
-    TeamMsgs result = -1;
+    char *args = &line[strlen(type)];
+    if (*args == ' ') {
+        args++;
+    }
+    msg->name = NULL;
     if (strcmp(type, "fightmeirl") == 0) {
-        result = FIGHTMEIRL;
+        msg->type = FIGHTMEIRL;
+        msg->name = get_token(args, '\0');
     } else if (strcmp(type, "haveatyou") == 0) {
-        result = HAVEATYOU;
+        msg->type = HAVEATYOU;
+        msg->name = get_token(args, '\0');
     } else if (strcmp(type, "iselectyou") == 0) {
-        result = ISELECTYOU;
+        msg->type = ISELECTYOU;
+        if ((msg->agent = get_agent(game, args)) == NULL) {
+            exit_game(EXIT_BAD_MESSAGE);
+        }
     } else if (strcmp(type, "attack") == 0) {
-        result = ATTACK;
+        msg->type = ATTACK;
+        char *agentName = get_token(args, ' ');
+        char *attackName = &args[strlen(agentName)];
+        msg->agent = get_agent(game, agentName);
+        msg->attack = *attackName == ' ' ? 
+                get_attack(game, attackName + 1) : NULL;
+        if (msg->agent == NULL || msg->attack == NULL) {
+            exit_game(EXIT_BAD_MESSAGE);
+        }
+        free(agentName);
     } else {
         exit_game(EXIT_BAD_MESSAGE);
     }
     free(type);
-    return result;
 }
 
 /**
- * Returns a team member whose agent is specified in an "iselectyou" message
- *      read from opposing->read.
- * Exits with protocol error if invalid message.
+ * Returns the agent or attack whose ID is stored at data, or NULL if there is
+ *      none.
  */
-Member *get_selected_opponent(Game *game, Team *opposing, char **narrative) {
-    Member *opponent = malloc(sizeof(Member));
-    opponent->health = MAX_HEALTH;
+void *get_id(void **list, int count, unsigned char *data) {
+    int id = get_number(data, 2);
+    return id < count ? list[id] : NULL;
+}
 
-    // read iselectyou message
-    char *message = malloc(sizeof(char) * BUFFER);
-    if (read_team_msg(message, BUFFER, opposing->read, game) != ISELECTYOU) {
-        exit_game(EXIT_BAD_MESSAGE); // not iselectyou
+/**
+ * Returns the team members described by the given lineup frame payload, each
+ *      with full health and its rotation at the start.
+ * Exits with protocol error if the lineup is invalid.
+ */
+Member *decode_lineup(Game *game, unsigned char *payload, int size) {
+    Member *lineup = malloc(sizeof(Member) * MAX_TEAM_PLAYERS);
+    int pos = 0;
+    for (int i = 0; i < MAX_TEAM_PLAYERS; i++) {
+        Member *member = &lineup[i];
+        if (pos + 4 > size) {
+            exit_game(EXIT_BAD_MESSAGE);
+        }
+        member->agent = get_id((void **)game->agents, game->numAgents, 
+                &payload[pos]);
+        member->numAttacks = get_number(&payload[pos + 2], 2);
+        pos += 4;
+        if (member->agent == NULL || member->numAttacks == 0 || 
+                pos + 2 * member->numAttacks > size) {
+            exit_game(EXIT_BAD_MESSAGE);
+        }
+        member->attacks = malloc(sizeof(int) * member->numAttacks);
+        for (int j = 0; j < member->numAttacks; j++, pos += 2) {
+            Attack *attack = get_id((void **)game->attacks, game->numAttacks,
+                    &payload[pos]);
+            if (attack == NULL || !legal_attack(member->agent, attack)) {
+                exit_game(EXIT_BAD_MESSAGE);
+            }
+            member->attacks[j] = attack->id;
+        }
+        member->nextAttack = 0;
+        member->health = MAX_HEALTH;
     }
-
-    // get agent
-    char *agentName = get_token(&message[strlen("iselectyou ")], '\0');
-    free(message);
-    if ((opponent->agent = get_agent(game, agentName)) == NULL) {
+    if (pos != size) {
         exit_game(EXIT_BAD_MESSAGE);
     }
-    free(agentName);
+    return lineup;
+}
+
+/**
+ * Decodes the given binary frame from another team into msg.
+ * Exits with protocol error if invalid frame.
+ */
+void decode_team_frame(Game *game, int opcode, unsigned char *payload, 
+        int size, TeamMsg *msg) {
+    msg->name = NULL;
+    switch (opcode) {
+        case OP_FIGHTMEIRL:
+        case OP_HAVEATYOU:
+            msg->type = opcode == OP_FIGHTMEIRL ? FIGHTMEIRL : HAVEATYOU;
+            msg->name = malloc(sizeof(char) * (size + 1));
+            memcpy(msg->name, payload, size);
+            msg->name[size] = '\0';
+            return;
+        case OP_ISELECTYOU:
+            msg->type = ISELECTYOU;
+            msg->agent = size == 2 ? get_id((void **)game->agents, 
+                    game->numAgents, payload) : NULL;
+            if (msg->agent == NULL) {
+                exit_game(EXIT_BAD_MESSAGE);
+            }
+            return;
+        case OP_ATTACK:
+            msg->type = ATTACK;
+            if (size != 4) {
+                exit_game(EXIT_BAD_MESSAGE);
+            }
+            msg->agent = get_id((void **)game->agents, game->numAgents, 
+                    &payload[0]);
+            msg->attack = get_id((void **)game->attacks, game->numAttacks,
+                    &payload[2]);
+            if (msg->agent == NULL || msg->attack == NULL) {
+                exit_game(EXIT_BAD_MESSAGE);
+            }
+            return;
+        case OP_LINEUP:
+            msg->type = LINEUP;
+            msg->lineup = decode_lineup(game, payload, size);
+            return;
+        case OP_VERDICT:
+            msg->type = VERDICT;
+            if (size != 4) {
+                exit_game(EXIT_BAD_MESSAGE);
+            }
+            msg->digest = get_number(payload, 4);
+            return;
+        default:
+            exit_game(EXIT_BAD_MESSAGE);
+    }
+}
+
+/**
+ * Sends the given message to the controller, or a binary frame with the 
+ *      given opcode if it speaks binary. The frame's payload is whatever
+ *      follows the first space in message.
+ */
+void tell_controller(Game *game, int opcode, char *message) {
+    if (game->binary) {
+        char *args = strchr(message, ' ');
+        args = args == NULL ? "" : args + 1;
+        write_frame(game->write, opcode, (unsigned char *)args, strlen(args));
+    } else {
+        fprintf(game->write, "%s\n", message);
+    }
+    fflush(game->write);
+}
+
+/**
+ * Handles an opposing team disconnecting mid-battle: sends "disco" to the 
+ *      controller in simulation mode, exits with team disconnected otherwise.
+ */
+void team_disconnected(Game *game) {
+    if (game->simulation) {
+        tell_controller(game, OP_DISCO, "disco"); // team gone in sim mode
+    } else {
+        exit_game(EXIT_TEAM_DISCO); // team disconnected in 1v1 mode
+    }
+}
+
+/**
+ * Returns a team member whose agent is specified in the given "iselectyou" 
+ *      message from the opposing team.
+ * Exits with protocol error if invalid message.
+ */
+Member *get_selected_opponent(Team *opposing, Narrative *narrative,
+        TeamMsg *msg) {
+    if (msg->type != ISELECTYOU) {
+        exit_game(EXIT_BAD_MESSAGE); // not iselectyou
+    }
+    Member *opponent = malloc(sizeof(Member));
+    opponent->health = MAX_HEALTH;
+    opponent->agent = msg->agent;
 
     // add to narrative
     append_string(narrative, "%s chooses %s\n", opposing->name,
@@ -266,203 +470,869 @@ Member *get_selected_opponent(Game *game, Team *opposing, char **narrative) {
 }
 
 /**
- * Sends a message to opposition that this team member has been selected.
+ * Queues a message to opposition that this team member has been selected.
  * Adds to narrative.
  * Returns a copy of the given team member with full health.
  */
-Member *select_member(char **narrative, FILE *opposition, char *teamName, 
+Member *select_member(Narrative *narrative, Team *opposing, char *teamName, 
         Member *member) {
     Member *copy = malloc(sizeof(Member));
     copy->agent = member->agent;
     copy->health = MAX_HEALTH;
-    copy->nextAttack = member->firstAttack;
-    fprintf(opposition, "iselectyou %s\n", copy->agent->name);
-    fflush(opposition);
+    copy->attacks = member->attacks;
+    copy->numAttacks = member->numAttacks;
+    copy->nextAttack = 0;
+    if (opposing->binary) {
+        unsigned char payload[2];
+        put_number(payload, copy->agent->id, 2);
+        write_frame(opposing->write, OP_ISELECTYOU, payload, 2);
+    } else {
+        fprintf(opposing->write, "iselectyou %s\n", copy->agent->name);
+    }
     append_string(narrative, "%s chooses %s\n", teamName, member->agent->name);
     return copy;
 }
 
 /**
- * Reads and processes an attack from the opposing team.
+ * Processes the given attack message from the opposing team.
  * Exits with protocol error if invalid information received.
  */
-void get_attacked(Game *game, char **narrative, Member *member,
-        Member *opponent, Team *opposing) {
-    char *message = malloc(sizeof(char) * BUFFER);
-    if (read_team_msg(message, BUFFER, opposing->read, game) != ATTACK) {
+void get_attacked(Game *game, Narrative *narrative, Member *member,
+        Member *opponent, TeamMsg *msg) {
+    if (msg->type != ATTACK) {
         exit_game(EXIT_BAD_MESSAGE); // attack message not received
     }
 
-    // figure out what attack is being used on us
-    char *agentName = get_token(&message[strlen("attack ")], ' ');
-    Attack *attack = get_attack(game, &message[strlen("attack  ") +
-            strlen(opponent->agent->name)]);
-    if (attack == NULL || !legal_attack(opponent->agent, attack) ||
-            strcmp(agentName, opponent->agent->name) != 0) {
-        // invalid attack, invalid agent, or illegal attack for that agent
+    // check the attack being used on us
+    Attack *attack = msg->attack;
+    if (msg->agent != opponent->agent || !legal_attack(opponent->agent, 
+            attack)) {
+        // wrong agent, or illegal attack for that agent
         exit_game(EXIT_BAD_MESSAGE);
     }
-    free(agentName);
 
     // update our stats and add to narrative
-    int effectiveness = get_effectiveness(attack, member->agent);
-    member->health -= effectiveness;
-    append_string(narrative, "%s uses %s: %s", opponent->agent->name, 
-            attack->name, attack->type->effectiveness[effectiveness - 1]);
-    if (member->health <= 0) {
-        append_string(narrative, " - %s was eliminated.", member->agent->name);
-    }
-    append_string(narrative, "\n");
-    free(message);
+    narrate_attack(narrative, game, opponent, attack, member);
+}
+
+/**
+ * Queues "fightmeirl" or "haveatyou" (opcode says which) for the opposing 
+ *      team, giving our team name.
+ */
+void send_greeting(Game *game, Team *opposing, int opcode) {
+    char *name = game->team->name;
+    if (opposing->binary) {
+        write_frame(opposing->write, opcode, (unsigned char *)name, 
+                strlen(name));
+    } else {
+        fprintf(opposing->write, "%s %s\n", 
+                opcode == OP_FIGHTMEIRL ? "fightmeirl" : "haveatyou", name);
+    }
 }
 
 /**
- * Battles game->team and opposing team. goFirst should be true when game->team
- *     is to attack first, false otherwise. Battle story added to narrative.
- * Calling thread exits with protocol error if bad message found; or exits if
- *     opposing team disconnects (with status 0 in sim mode, 10 otherwise).
+ * Queues our lineup for the opposing team, offering (or agreeing) to work out
+ *      the battle locally.
  */
-void battle(char **narrative, Game *game, Team *opposing, bool goFirst) {
-    char *msg = malloc(sizeof(char) * BUFFER);
-    Team *loser = game->team;
-    Member *opponent;
-    if (!goFirst) {
-        opponent = get_selected_opponent(game, opposing, narrative);
+void send_lineup(Game *game, Team *opposing) {
+    int size = 0;
+    for (int i = 0; i < MAX_TEAM_PLAYERS; i++) {
+        size += 4 + 2 * game->team->members[i]->numAttacks;
     }
+    unsigned char *payload = malloc(sizeof(char) * size);
+    int pos = 0;
+    for (int i = 0; i < MAX_TEAM_PLAYERS; i++) {
+        Member *member = game->team->members[i];
+        put_number(&payload[pos], member->agent->id, 2);
+        put_number(&payload[pos + 2], member->numAttacks, 2);
+        pos += 4;
+        for (int j = 0; j < member->numAttacks; j++, pos += 2) {
+            put_number(&payload[pos], member->attacks[j], 2);
+        }
+    }
+    write_frame(opposing->write, OP_LINEUP, payload, size);
+    free(payload);
+}
 
-    // i is the index of our team's agent, j is index of opposing agent
-    for (int i = 0, j = 0; i < MAX_TEAM_PLAYERS && j < MAX_TEAM_PLAYERS; ++i) {
-        Member *member = select_member(narrative, opposing->write, 
-                game->team->name, game->team->members[i]);
+/**
+ * True if we can work out a battle against the opposing team locally: both 
+ *      teams speak binary and have opted in.
+ */
+bool local_battles(Game *game, Team *opposing) {
+    return game->localBattles && opposing->binary;
+}
 
-        // first round only
-        if (i == 0) {
-            if (!goFirst) {
-                get_attacked(game, narrative, member, opponent, opposing);
-            } else {
-                opponent = get_selected_opponent(game, opposing, narrative);
-            }
+/**
+ * Starts a battle against the opposing team, sending "fightmeirl" if we are
+ *     the challenger (after our lineup, if we can offer to work the battle
+ *     out locally). The battle is then driven by step_battle().
+ */
+Battle *new_battle(Game *game, Team *opposing, bool challenger) {
+    Battle *battle = malloc(sizeof(Battle));
+    battle->game = game;
+    battle->opposing = opposing;
+    battle->goFirst = challenger;
+    init_narrative(&battle->narrative);
+    battle->loser = game->team;
+    battle->i = 0;
+    battle->j = 0;
+    battle->lineup = NULL;
+    battle->transcript = NULL;
+    battle->marks = NULL;
+    battle->heard = 0;
+    battle->room = 0;
+    battle->replaying = false;
+    battle->start = challenger ? now_ms() : 0;
+    if (challenger) {
+        if (local_battles(game, opposing)) {
+            send_lineup(game, opposing);
         }
+        send_greeting(game, opposing, OP_FIGHTMEIRL);
+        fflush(opposing->write);
+        battle->state = AWAIT_HAVEATYOU;
+    } else {
+        battle->state = AWAIT_FIGHTMEIRL;
+    }
+    return battle;
+}
 
-        // fight until our agent dies or whole opposing team dies
-        while (member->health > 0) {
-            attack(narrative, game, opposing->write, member, opponent);
-            if (opponent->health <= 0) { 
-                if (++j == MAX_TEAM_PLAYERS) {
-                    loser = opposing;
-                    break; 
-                }
-                free(opponent);
-                opponent = get_selected_opponent(game, opposing, narrative);
+/**
+ * Frees the battle, along with any lineup the opposing team sent and its
+ *      transcript.
+ */
+void free_battle(Battle *battle) {
+    if (battle->lineup != NULL) {
+        for (int i = 0; i < MAX_TEAM_PLAYERS; i++) {
+            free(battle->lineup[i].attacks);
+        }
+        free(battle->lineup);
+    }
+    free(battle->transcript);
+    free(battle->marks);
+    free(battle);
+}
+
+/**
+ * Sets up game->results with no battles in it.
+ */
+void new_battle_cache(Game *game) {
+    struct BattleCache *cache = malloc(sizeof(struct BattleCache));
+    init_symbols(&cache->keys);
+    cache->records = NULL;
+    cache->numRecords = 0;
+    sem_init(&cache->lock, 0, 1);
+    game->results = cache;
+}
+
+/**
+ * Sets up game->stats with nothing recorded, to be dumped to STATS_ENV's file
+ *      on exit if it is set, or to stderr on SIGUSR1 if not.
+ * Exits with system error if STATS_ENV's file can't be opened.
+ */
+void new_team_stats(Game *game) {
+    struct TeamStats *stats = malloc(sizeof(struct TeamStats));
+    init_histogram(&stats->battles);
+    init_histogram(&stats->waits);
+    init_histogram(&stats->connects);
+    stats->running = 0;
+    stats->peak = 0;
+    stats->started = 0;
+    char *path = getenv(STATS_ENV);
+    stats->output = stderr;
+    stats->dumpAtEnd = path != NULL;
+    if (path != NULL && strcmp(path, "-") != 0) {
+        stats->output = fopen(path, "a");
+        if (stats->output == NULL) {
+            exit_game(EXIT_SYSTEM);
+        }
+    }
+    game->stats = stats;
+}
+
+/**
+ * Dumps game->stats, headed by our team name and pid so that the dumps of
+ *      many teams can share a file.
+ */
+void dump_team_stats(Game *game) {
+    struct TeamStats *stats = game->stats;
+    FILE *file = stats->output;
+    flockfile(file);
+    fprintf(file, "team %s pid %d: challenge threads running %d peak %d "
+            "started %d\n", game->team == NULL || game->team->name == NULL ?
+            "?" : game->team->name, (int)getpid(),
+            __atomic_load_n(&stats->running, __ATOMIC_RELAXED),
+            __atomic_load_n(&stats->peak, __ATOMIC_RELAXED),
+            __atomic_load_n(&stats->started, __ATOMIC_RELAXED));
+    print_histogram(file, "  battles", &stats->battles);
+    print_histogram(file, "  waits", &stats->waits);
+    print_histogram(file, "  connects", &stats->connects);
+    fflush(file);
+    funlockfile(file);
+}
+
+/**
+ * Stats thread: dumps game->stats each time SIGUSR1 arrives.
+ * args should be a Game *.
+ */
+void *run_team_stats(void *args) {
+    Game *game = (Game *)args;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    while (true) {
+        int signal;
+        if (sigwait(&signals, &signal) == 0) {
+            dump_team_stats(game);
+        }
+    }
+}
+
+/**
+ * Starts the stats thread. SIGUSR1 is blocked here first, so must be called
+ *      before any other thread is created for them all to leave it to it.
+ */
+void start_team_stats(Game *game) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t stats;
+    pthread_create(&stats, NULL, run_team_stats, (void *)game);
+    pthread_detach(stats);
+}
+
+/**
+ * Exits normally, dumping game->stats first if asked to.
+ */
+void end_game(Game *game) {
+    if (game->stats->dumpAtEnd) {
+        dump_team_stats(game);
+    }
+    exit(0);
+}
+
+/**
+ * Counts a challenge thread starting (started is true) or finishing.
+ */
+void count_challenge_thread(Game *game, bool started) {
+    struct TeamStats *stats = game->stats;
+    if (!started) {
+        __atomic_sub_fetch(&stats->running, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&stats->started, 1, __ATOMIC_RELAXED);
+    int running = __atomic_add_fetch(&stats->running, 1, __ATOMIC_RELAXED);
+    int peak = __atomic_load_n(&stats->peak, __ATOMIC_RELAXED);
+    while (running > peak && !__atomic_compare_exchange_n(&stats->peak, &peak,
+            running, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // someone else changed the peak; peak now has theirs
+    }
+}
+
+/**
+ * True if the battle is being worked out locally rather than exchanged.
+ */
+bool worked_out_locally(Battle *battle) {
+    return battle->lineup != NULL && local_battles(battle->game, 
+            battle->opposing);
+}
+
+/**
+ * Returns the battle's key in game->results: who goes first, then 'L' and
+ *      each member of the opposing team's lineup as its agent and attack IDs
+ *      if it is worked out locally (or 'X' if not), then their name. Must be
+ *      freed.
+ */
+char *battle_key(Battle *battle) {
+    Narrative key;
+    init_narrative(&key);
+    append_string(&key, "%c", battle->goFirst ? 'F' : 'S');
+    if (!worked_out_locally(battle)) {
+        append_string(&key, "X");
+    } else {
+        append_string(&key, "L");
+        for (int i = 0; i < MAX_TEAM_PLAYERS; i++) {
+            Member *member = &battle->lineup[i];
+            append_string(&key, "%d", member->agent->id);
+            for (int j = 0; j < member->numAttacks; j++) {
+                append_string(&key, ",%d", member->attacks[j]);
             }
-            get_attacked(game, narrative, member, opponent, opposing);
+            append_string(&key, ";");
         }
-        free(member);
     }
+    append_string(&key, "%s", battle->opposing->name);
+    return key.text;
+}
+
+/**
+ * Looks the battle up in game->results. If it has been fought before, the
+ *      battle replays: it is not worked out or rendered again, and the cached
+ *      narrative is used when it ends. An exchanged battle replays the first
+ *      battle with its key until what the opposing team sends shows it to be
+ *      another one (see hear()). Thread-safe.
+ */
+void check_results(Battle *battle) {
+    struct BattleCache *cache = battle->game->results;
+    char *key = battle_key(battle);
+    sem_wait(&cache->lock);
+    int index = lookup_symbol(&cache->keys, key);
+    if (index >= 0) {
+        battle->cached = cache->records[index];
+        battle->replaying = true;
+        battle->narrative.muted = true;
+    }
+    sem_post(&cache->lock);
+    free(key);
+}
+
+/**
+ * True if the record's transcript starts with the first count messages of
+ *      the battle's.
+ */
+bool transcript_matches(BattleRecord *record, Battle *battle, int count) {
+    return record->numHeard >= count && (count == 0 || memcmp(
+            record->transcript, battle->transcript, 
+            sizeof(uint64_t) * count) == 0);
+}
+
+/**
+ * Adds the finished battle's result to game->results, unless another thread
+ *      beat us to it. The battle's transcript goes with it. Thread-safe.
+ */
+void remember_result(Battle *battle) {
+    struct BattleCache *cache = battle->game->results;
+    char *key = battle_key(battle);
+    sem_wait(&cache->lock);
+    int index = lookup_symbol(&cache->keys, key);
+    int last = -1;
+    for (int i = index; i >= 0; i = cache->records[i].next) {
+        BattleRecord *record = &cache->records[i];
+        if (record->numHeard == battle->heard && 
+                transcript_matches(record, battle, battle->heard)) {
+            sem_post(&cache->lock);
+            free(key);
+            return; // already there
+        }
+        last = i;
+    }
+    cache->records = realloc(cache->records, sizeof(BattleRecord) * 
+            (cache->numRecords + 1));
+    BattleRecord *record = &cache->records[cache->numRecords];
+    record->narrative = strdup(battle->narrative.text);
+    record->digest = battle->digest;
+    record->transcript = battle->transcript;
+    record->marks = battle->marks;
+    record->numHeard = battle->heard;
+    record->next = -1;
+    battle->transcript = NULL;
+    battle->marks = NULL;
+    if (last < 0) {
+        add_symbol(&cache->keys, key, cache->numRecords++);
+    } else {
+        cache->records[last].next = cache->numRecords++;
+        free(key);
+    }
+    sem_post(&cache->lock);
+}
+
+/**
+ * Adds the member or attack the opposing team sent in msg to the battle's 
+ *      transcript. A replaying battle looks for a cached battle that went the
+ *      same way up to now, and if there is none, picks its narrative up from
+ *      where the one it was replaying stops matching. Thread-safe.
+ */
+void hear(Battle *battle, TeamMsg *msg) {
+    if (battle->heard == battle->room) {
+        battle->room = battle->room == 0 ? 16 : battle->room * 2;
+        battle->transcript = realloc(battle->transcript, 
+                sizeof(uint64_t) * battle->room);
+        battle->marks = realloc(battle->marks, sizeof(size_t) * battle->room);
+    }
+    int heard = battle->heard++;
+    battle->transcript[heard] = (uint64_t)msg->agent->id << 32 | 
+            (msg->type == ATTACK ? msg->attack->id + 1 : 0);
+    battle->marks[heard] = battle->narrative.length;
+    if (!battle->replaying || 
+            transcript_matches(&battle->cached, battle, battle->heard)) {
+        return;
+    }
+
+    struct BattleCache *cache = battle->game->results;
+    sem_wait(&cache->lock);
+    for (int i = battle->cached.next; i >= 0; i = cache->records[i].next) {
+        if (transcript_matches(&cache->records[i], battle, battle->heard)) {
+            battle->cached = cache->records[i];
+            sem_post(&cache->lock);
+            return;
+        }
+    }
+    sem_post(&cache->lock);
+
+    // a new battle: everything up to this message went as the cached one did
+    battle->replaying = false;
+    battle->narrative.muted = false;
+    memcpy(battle->marks, battle->cached.marks, sizeof(size_t) * battle->heard);
+    append_string(&battle->narrative, "%.*s", (int)battle->marks[heard],
+            battle->cached.narrative);
+}
+
+/**
+ * Ends the battle, adding its narrative to game->narratives and remembering
+ *      it in game->results if it wasn't a replay.
+ */
+void end_battle(Battle *battle) {
+    if (battle->replaying) {
+        free(battle->narrative.text);
+        add_narrative(battle->game, strdup(battle->cached.narrative));
+    } else {
+        append_string(&battle->narrative, "Team %s was eliminated.\n", 
+                battle->loser->name);
+        remember_result(battle);
+        add_narrative(battle->game, battle->narrative.text);
+    }
+    battle->state = BATTLE_OVER;
+    record_latency(&battle->game->stats->battles, now_ms() - battle->start);
+}
 
-    free(msg);
-    append_string(narrative, "Team %s was eliminated.\n", loser->name);
-    add_narrative(game, *narrative);
+/**
+ * Sends out our first team member, then waits for either the opposing 
+ *     team's first member or their first attack, depending on who goes first.
+ */
+void select_first_member(Battle *battle) {
+    Game *game = battle->game;
+    battle->member = select_member(&battle->narrative, battle->opposing,
+            game->team->name, game->team->members[0]);
+    battle->state = battle->goFirst ? AWAIT_OPENING_OPPONENT : AWAIT_ATTACK;
 }
 
 /**
- * Goes through wait mode. Game narrative is added to game->narratives.
- * Calling thread exits if a protocol error or team disconnected error occurs.
+ * Attacks until we need to hear from the opposing team: fights until the 
+ *     opposing member dies or we run out of members, sending out our next
+ *     member whenever ours is eliminated.
  */
-void be_challenged(Game *game, Team *opposing) {
-    FILE *read = opposing->read;
-    char *msg = malloc(sizeof(char) * BUFFER);
-    char *narrative = malloc(sizeof(char));
-    narrative[0] = '\0';
+void fight(Battle *battle) {
+    Game *game = battle->game;
+    while (battle->member->health <= 0) {
+        // our agent has died; send out the next one if we have one
+        free(battle->member);
+        if (++battle->i == MAX_TEAM_PLAYERS) {
+            free(battle->opponent);
+            end_battle(battle);
+            return;
+        }
+        battle->member = select_member(&battle->narrative, 
+                battle->opposing, game->team->name, 
+                game->team->members[battle->i]);
+    }
+    attack(&battle->narrative, game, battle->opposing, battle->member, 
+            battle->opponent);
+    if (battle->opponent->health <= 0) { 
+        free(battle->opponent);
+        if (++battle->j == MAX_TEAM_PLAYERS) {
+            free(battle->member);
+            battle->loser = battle->opposing;
+            end_battle(battle);
+        } else {
+            battle->state = AWAIT_NEXT_OPPONENT;
+        }
+        return;
+    }
+    battle->state = AWAIT_ATTACK;
+}
 
-    // setup communication
-    if (read_team_msg(msg, BUFFER, read, game) != FIGHTMEIRL) {
-        exit_game(EXIT_BAD_MESSAGE); 
+/**
+ * Works the whole battle out from both teams' lineups, exactly as the 
+ *     exchange of attacks would have gone, then queues a digest of it for the
+ *     opposing team to check against theirs.
+ */
+void resolve_battle(Battle *battle) {
+    Game *game = battle->game;
+    size_t start = 0;
+    if (!battle->replaying) {
+        // their lineup stands in for their members
+        Team opposing = *battle->opposing;
+        for (int i = 0; i < MAX_TEAM_PLAYERS; i++) {
+            opposing.members[i] = &battle->lineup[i];
+        }
+        Team *loser = battle->goFirst ? 
+                play_battle(game, &battle->narrative, game->team, &opposing,
+                &start) :
+                play_battle(game, &battle->narrative, &opposing, game->team,
+                &start);
+        battle->loser = loser == game->team ? loser : battle->opposing;
+    }
+
+    battle->digest = battle->replaying ? battle->cached.digest :
+            hash_name(battle->narrative.text + start, 
+            battle->narrative.length - start);
+    unsigned char payload[4];
+    put_number(payload, battle->digest, 4);
+    write_frame(battle->opposing->write, OP_VERDICT, payload, 4);
+    battle->state = AWAIT_VERDICT;
+}
+
+/**
+ * Advances the battle with the next message received from the opposing team,
+ *     running our side until we next need to hear from them. Our replies are
+ *     queued on opposing->write and flushed in one go before returning.
+ * Returns true once the battle is over (its narrative has been added to
+ *     game->narratives).
+ * Exits with protocol error if bad message found.
+ */
+bool step_battle(Battle *battle, TeamMsg *msg) {
+    Team *opposing = battle->opposing;
+    if (battle->start == 0) {
+        battle->start = now_ms(); // we have just been challenged
+    }
+    if (msg->type == ISELECTYOU || msg->type == ATTACK) {
+        hear(battle, msg);
+    }
+    if (msg->type == LINEUP && battle->lineup == NULL && 
+            (battle->state == AWAIT_FIGHTMEIRL || 
+            (battle->state == AWAIT_HAVEATYOU && 
+            local_battles(battle->game, opposing)))) {
+        // they offer (or agree) to work the battle out locally; their
+        // greeting follows
+        battle->lineup = msg->lineup;
+        return false;
+    }
+    switch (battle->state) {
+        case AWAIT_FIGHTMEIRL:
+        case AWAIT_HAVEATYOU:
+            if (msg->type != (battle->state == AWAIT_FIGHTMEIRL ? 
+                    FIGHTMEIRL : HAVEATYOU)) {
+                exit_game(EXIT_BAD_MESSAGE); 
+            }
+            free(opposing->name); // from our last battle with them
+            opposing->name = msg->name;
+            bool local = worked_out_locally(battle);
+            check_results(battle);
+            append_string(&battle->narrative, 
+                    "%s has a difference of opinion\n", opposing->name);
+            if (battle->state == AWAIT_FIGHTMEIRL) {
+                if (local) {
+                    send_lineup(battle->game, opposing); // we agree
+                }
+                send_greeting(battle->game, opposing, OP_HAVEATYOU);
+                battle->state = AWAIT_FIRST_OPPONENT;
+                if (local) {
+                    resolve_battle(battle);
+                }
+            } else if (local) {
+                resolve_battle(battle); // they agreed
+            } else {
+                select_first_member(battle);
+            }
+            break;
+        case AWAIT_VERDICT:
+            if (msg->type != VERDICT || msg->digest != battle->digest) {
+                exit_game(EXIT_BAD_MESSAGE); // we don't agree on the battle
+            }
+            end_battle(battle);
+            break;
+        case AWAIT_FIRST_OPPONENT:
+            battle->opponent = get_selected_opponent(opposing,
+                    &battle->narrative, msg);
+            select_first_member(battle);
+            break;
+        case AWAIT_OPENING_OPPONENT:
+            battle->opponent = get_selected_opponent(opposing,
+                    &battle->narrative, msg);
+            fight(battle);
+            break;
+        case AWAIT_NEXT_OPPONENT:
+            battle->opponent = get_selected_opponent(opposing,
+                    &battle->narrative, msg);
+            battle->state = AWAIT_ATTACK;
+            break;
+        case AWAIT_ATTACK:
+            get_attacked(battle->game, &battle->narrative, battle->member,
+                    battle->opponent, msg);
+            fight(battle);
+            break;
+        default:
+            exit_game(EXIT_BAD_MESSAGE); // nothing expected after the end
     }
-    opposing->name = get_token(&msg[strlen("fightmeirl ")], 0);
-    append_string(&narrative, "%s has a difference of opinion\n", opposing->name);
-    fprintf(opposing->write, "haveatyou %s\n", game->team->name);
+    // we're about to wait on the opposing team (or are done with them), so
+    // everything we've queued since their last message goes out together
     fflush(opposing->write);
+    return battle->state == BATTLE_OVER;
+}
 
-    battle(&narrative, game, opposing, false);
+/**
+ * Reads the next message from opposing->read into msg, as text or a binary
+ *     frame depending on what the opposing team speaks, noting how long we
+ *     waited for it.
+ * Returns false if the opposing team has disconnected.
+ * Exits with protocol error if bad message found.
+ */
+bool read_team_msg(Game *game, Team *opposing, TeamMsg *msg, 
+        unsigned char *buffer) {
+    double start = now_ms();
+    if (opposing->binary) {
+        int size;
+        int opcode = read_frame(opposing->read, buffer, &size);
+        if (opcode < 0) {
+            return false;
+        }
+        record_latency(&game->stats->waits, now_ms() - start);
+        decode_team_frame(game, opcode, buffer, size, msg);
+        return true;
+    }
+    char *line = malloc(sizeof(char) * BUFFER);
+    line = read_line(line, BUFFER, opposing->read);
+    record_latency(&game->stats->waits, now_ms() - start);
+    bool received = strlen(line) > 0; // blank line reads as EOF
+    if (received) {
+        parse_team_msg(game, line, msg);
+    }
+    free(line);
+    return received;
 }
 
 /**
- * For qsorting strings in lexicographical order
+ * Runs the battle to completion, reading each message from opposing->read.
+ * Returns false if the opposing team disconnected ("disco" has been sent to 
+ *     the controller).
+ * Exits with protocol error if bad message found, or with team disconnected
+ *     if the opposing team disconnects in 1v1 mode.
  */
-int sort_strings(const void *a, const void *b) {
-    return strcmp(*(char **)a, *(char **)b);
+bool battle(Battle *battle) {
+    unsigned char *buffer = malloc(sizeof(char) * MAX_PAYLOAD);
+    bool finished = false;
+    TeamMsg msg;
+    do {
+        if (!read_team_msg(battle->game, battle->opposing, &msg, buffer)) {
+            team_disconnected(battle->game);
+            break;
+        }
+    } while (!(finished = step_battle(battle, &msg)));
+    free(buffer);
+    free_battle(battle);
+    return finished;
 }
 
 /**
- * Prints the game's narratives list in lexicographical order.
- * Frees narratives and resets numNarratives to 0.
+ * Returns the given list of narratives merge sorted into lexicographical 
+ *      order.
+ */
+NarrativeNode *sort_narratives(NarrativeNode *list) {
+    if (list == NULL || list->next == NULL) {
+        return list;
+    }
+
+    // split the list in half, then sort each half
+    NarrativeNode *slow = list, *fast = list->next;
+    while (fast != NULL && fast->next != NULL) {
+        slow = slow->next;
+        fast = fast->next->next;
+    }
+    NarrativeNode *a = sort_narratives(slow->next);
+    slow->next = NULL;
+    NarrativeNode *b = sort_narratives(list);
+
+    // merge the two halves
+    NarrativeNode head;
+    NarrativeNode *tail = &head;
+    while (a != NULL && b != NULL) {
+        if (strcmp(a->text, b->text) < 0) {
+            tail->next = a;
+            a = a->next;
+        } else {
+            tail->next = b;
+            b = b->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = (a != NULL) ? a : b;
+    return head.next;
+}
+
+/**
+ * Prints the game's narratives in lexicographical order.
+ * Frees narratives and leaves the game with none.
  */
 void print_and_free_narratives(Game *game) {
-    qsort(game->narratives, game->numNarratives, sizeof(char *), sort_strings);
-    for (int i = 0; i < game->numNarratives; i++) {
-        printf("%s", game->narratives[i]);
-        free(game->narratives[i]);
+    NarrativeNode *list = sort_narratives(__atomic_exchange_n(
+            &game->narratives, NULL, __ATOMIC_ACQUIRE));
+    while (list != NULL) {
+        NarrativeNode *next = list->next;
+        printf("%s", list->text);
+        free(list->text);
+        free(list);
+        list = next;
     }
     fflush(stdout);
-    game->numNarratives = 0;
 }
 
 /**
  * Challenges the opposing team and adds the narrative to game->narratives upon
  *     completion.
- * Exits if a bad message is received or if opposing team disconnects.
+ * Returns false if the opposing team disconnected in simulation mode.
+ * Exits if a bad message is received or if opposing team disconnects in 1v1
+ *     mode.
  */
-void challenge(Game *game, Team *opposing) {
-    char *narrative = malloc(sizeof(char));
-    narrative[0] = '\0';
-    char *message = malloc(sizeof(char) * BUFFER);
+bool challenge(Game *game, Team *opposing) {
+    return battle(new_battle(game, opposing, true));
+}
 
-    // set-up communication
-    fprintf(opposing->write, "fightmeirl %s\n", game->team->name);
-    fflush(opposing->write);
-    if (read_team_msg(message, BUFFER, opposing->read, game) != HAVEATYOU) {
-        exit_game(EXIT_BAD_MESSAGE);
+/**
+ * Accepts a challenger on the listening socket and starts watching it.
+ * Exits with team connection error if the accept fails.
+ */
+void accept_challenger(Game *game, int fdServer, int fdEvents) {
+    Challenger *challenger = malloc(sizeof(Challenger));
+    Team *opposing = malloc(sizeof(Team));
+    // messages are received straight off the socket, so only write buffered
+    challenger->fd = accept(fdServer, NULL, NULL);
+    if (challenger->fd < 0) {
+        exit_game(EXIT_CONNECT_TEAM);
     }
-    opposing->name = get_token(&message[strlen("haveatyou ")], '\0');
-    append_string(&narrative, "%s has a difference of opinion\n", 
-            opposing->name);
-    free(message);
+    opposing->name = NULL;
+    opposing->read = NULL;
+    opposing->write = fdopen(challenger->fd, "w");
+    opposing->binary = false; // until we see their first message
+    challenger->battle = new_battle(game, opposing, false);
+    challenger->capacity = BUFFER;
+    challenger->input = malloc(sizeof(char) * challenger->capacity);
+    challenger->length = 0;
+    challenger->battles = 0;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = challenger;
+    if (epoll_ctl(fdEvents, EPOLL_CTL_ADD, challenger->fd, &event) < 0) {
+        exit_game(EXIT_SYSTEM);
+    }
+}
 
-    battle(&narrative, game, opposing, true);
+/**
+ * Stops watching a challenger who has gone.
+ */
+void drop_challenger(Challenger *challenger, int fdEvents) {
+    epoll_ctl(fdEvents, EPOLL_CTL_DEL, challenger->fd, NULL);
+    Team *opposing = challenger->battle->opposing;
+    fclose(opposing->write);
+    free(opposing->name);
+    free(opposing);
+    free_battle(challenger->battle);
+    free(challenger->input);
+    free(challenger);
 }
 
 /**
- * Runs wait mode, then either prints the resulting narrative or sends
- *     "donefighting" to the controller if in simulation mode. 
- * args should be a ThreadGame pointer.
- * Calling thread exits with NULL on success.
- * Exits if a bad message is received or if opposing team disconnects.
+ * Removes the next complete message from the challenger's input, decoding it
+ *     into msg.
+ * Returns false if there isn't a complete message yet, or sets gone and 
+ *     returns false if the challenger has sent a blank line (which reads as
+ *     EOF).
+ * Exits with protocol error if bad message found.
  */
-void *wait_wrapper(void *args) {
-    ThreadGame *params = (ThreadGame *)args;
-    be_challenged(params->game, params->opposing);
-    if (params->game->simulation) {
-        fprintf(params->game->write, "donefighting\n");
-        fflush(params->game->write);
-    } else {
-        print_and_free_narratives(params->game);
+bool next_challenger_msg(Game *game, Challenger *challenger, TeamMsg *msg, 
+        bool *gone) {
+    char *start = challenger->input + challenger->consumed;
+    int remaining = challenger->length - challenger->consumed;
+    if (challenger->battle->opposing->binary) {
+        int size = frame_size(start, remaining);
+        if (size == 0) {
+            return false;
+        }
+        decode_team_frame(game, start[0], (unsigned char *)&start[FRAME_HEADER],
+                size - FRAME_HEADER, msg);
+        challenger->consumed += size;
+        return true;
+    }
+    char *newline = memchr(start, '\n', remaining);
+    if (newline == NULL) {
+        return false;
+    }
+    *newline = '\0';
+    challenger->consumed += newline - start + 1;
+    if (strlen(start) == 0) {
+        *gone = true;
+        return false;
     }
-    pthread_exit(NULL);
+    parse_team_msg(game, start, msg);
+    return true;
+}
+
+/**
+ * Reads whatever the challenger has sent and steps its battle once for each
+ *     complete message. Once the battle is over, sends "donefighting" to the
+ *     controller and waits on the same connection for the challenger's next
+ *     "fightmeirl" (simulation mode), or prints the narrative and exits the
+ *     calling thread (1v1 mode).
+ * The first byte from the challenger says whether they speak text or binary
+ *     frames for the rest of the connection.
+ * A challenger hanging up between battles is not a disconnection, since it
+ *     only means their simulation is over.
+ * Returns true if the challenger should be dropped.
+ */
+bool handle_challenger(Game *game, Challenger *challenger) {
+    if (challenger->capacity - challenger->length < BUFFER) {
+        challenger->capacity *= 2;
+        challenger->input = realloc(challenger->input, challenger->capacity);
+    }
+    ssize_t n = recv(challenger->fd, challenger->input + challenger->length,
+            challenger->capacity - challenger->length, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || 
+            errno == EINTR)) {
+        return false; // nothing to read after all
+    } else if (n <= 0) {
+        if (challenger->battles == 0 || challenger->length > 0 ||
+                challenger->battle->state != AWAIT_FIGHTMEIRL) {
+            team_disconnected(game);
+        }
+        return true;
+    }
+    if (challenger->battles == 0 && challenger->length == 0 &&
+            challenger->battle->state == AWAIT_FIGHTMEIRL) {
+        // very first data on the connection; text always starts printable
+        challenger->battle->opposing->binary = 
+                (unsigned char)challenger->input[0] < ' ';
+    }
+    challenger->length += n;
+
+    // step the battle with each complete message
+    TeamMsg msg;
+    bool gone = false;
+    challenger->consumed = 0;
+    while (next_challenger_msg(game, challenger, &msg, &gone)) {
+        if (!step_battle(challenger->battle, &msg)) {
+            continue;
+        } else if (!game->simulation) {
+            print_and_free_narratives(game);
+            end_game(game);
+        }
+        tell_controller(game, OP_DONEFIGHTING, "donefighting");
+        Team *opposing = challenger->battle->opposing;
+        free_battle(challenger->battle);
+        challenger->battle = new_battle(game, opposing, false);
+        challenger->battles++;
+    }
+    if (gone) {
+        team_disconnected(game);
+        return true;
+    }
+    challenger->length -= challenger->consumed;
+    memmove(challenger->input, challenger->input + challenger->consumed, 
+            challenger->length);
+    return false;
 }
 
 /**
  * Starts listening on a port, and prints port if necessary. Accepts one or
  *     multiple connections depending on if game is in simulation mode.
- * Runs through a battle with each connected team.
+ * A single event loop drives the battles with every connected team, so no 
+ *     thread is needed per challenger.
  * Exits if bad message received or if opposing team disconnects.
  * args should be a Game *.
  */
 void *enter_wait_mode(void *args) {
     Game *game = (Game *)args;
     // start listening, and print port if necessary
-    int fd = open_listen(&game->team->port);
-    if (fd < 0) {
+    int fdServer = open_listen(&game->team->port);
+    if (fdServer < 0) {
         exit_game(EXIT_SYSTEM);
     }
     if (!game->simulation) {
@@ -470,36 +1340,66 @@ void *enter_wait_mode(void *args) {
         fflush(stdout);
     }
 
+    int fdEvents = epoll_create1(0);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // the listening socket
+    if (fdEvents < 0 || 
+            epoll_ctl(fdEvents, EPOLL_CTL_ADD, fdServer, &event) < 0) {
+        exit_game(EXIT_SYSTEM);
+    }
+
+    struct epoll_event events[BUFFER];
     while (true) {
-        ThreadGame *params = malloc(sizeof(ThreadGame));
-        Team *opposing = malloc(sizeof(Team));
-        // accept a connection and spawn another thread to battle
-        if (accept_connection(fd, &opposing->read, &opposing->write) < 0) {
-            exit_game(EXIT_CONNECT_TEAM);
+        int n = epoll_wait(fdEvents, events, BUFFER, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            exit_game(EXIT_SYSTEM);
         }
-        params->opposing = opposing;
-        params->game = game;
-        pthread_t waiter;
-        pthread_create(&waiter, NULL, wait_wrapper, (void *)params);
-        pthread_detach(waiter);
-        if (!game->simulation) {
-            pthread_exit(0); // stop this thread if we're doing one battle only
+        for (int i = 0; i < n; i++) {
+            Challenger *challenger = events[i].data.ptr;
+            if (challenger == NULL) {
+                accept_challenger(game, fdServer, fdEvents);
+                if (!game->simulation) {
+                    // one battle only; leave anyone else waiting
+                    epoll_ctl(fdEvents, EPOLL_CTL_DEL, fdServer, NULL);
+                }
+            } else if (handle_challenger(game, challenger)) {
+                drop_challenger(challenger, fdEvents);
+            }
         }
     }
 }
 
 /**
- * Connects to localhost on the given port. read and write will be set up to
- *     communicate over the resulting file descriptor.
- * Returns non-zero on error.
+ * Sets up game->peers with no connections, looking up localhost once for all
+ *     the connections we will make.
  */
-int connect_to_port(int port, FILE **read, FILE **write) {
-    struct sockaddr_in socketAddr;
+void new_peers(Game *game) {
+    struct Peers *peers = malloc(sizeof(struct Peers));
+    peers->peers = NULL;
+    peers->numPeers = 0;
+    sem_init(&peers->lock, 0, 1);
+
     struct addrinfo *addressInfo;
-    getaddrinfo("localhost", NULL, NULL, &addressInfo);
-    struct in_addr *ipAddress = 
-            &(((struct sockaddr_in *)(addressInfo->ai_addr))->sin_addr);
+    if (getaddrinfo("localhost", NULL, NULL, &addressInfo) != 0) {
+        exit_game(EXIT_SYSTEM);
+    }
+    peers->localhost = 
+            ((struct sockaddr_in *)(addressInfo->ai_addr))->sin_addr;
+    freeaddrinfo(addressInfo);
+    game->peers = peers;
+}
 
+/**
+ * Connects to localhost on the given port, noting how long it took. read and
+ *     write will be set up to communicate over the resulting file descriptor.
+ * Returns non-zero on error.
+ */
+int connect_to_port(Game *game, int port, FILE **read, FILE **write) {
+    double start = now_ms();
+    struct sockaddr_in socketAddr;
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
         exit_game(EXIT_SYSTEM);
@@ -508,188 +1408,137 @@ int connect_to_port(int port, FILE **read, FILE **write) {
     // attempt connection
     socketAddr.sin_family = AF_INET;
     socketAddr.sin_port = htons(port);
-    socketAddr.sin_addr.s_addr = ipAddress->s_addr;
+    socketAddr.sin_addr = game->peers->localhost;
     if (connect(fd, (struct sockaddr *)&socketAddr, sizeof(socketAddr)) < 0) {
+        close(fd);
         return -1;
     }
+    record_latency(&game->stats->connects, now_ms() - start);
     *read = fdopen(fd, "r");
-    *write = fdopen(fd, "w");
+    *write = fdopen(dup(fd), "w"); // so both streams can be closed
     return fd;
 }
 
 /**
- * Starts a challenge on the given port.
- * Can exit with protocol error, invalid port, or team disconnected on error.
+ * Returns a new connection to the team listening on the given port, using
+ *     binary frames if binary is true.
+ * Exits with team connection error if we cannot connect.
  */
-void enter_challenge_mode(Game *game, int port) {
-    // check port validity
-    if (!valid_port(port)) {
-        exit_game(EXIT_INVALID_PORT);
-    }
-    // set up connection to opposition
+Team *connect_to_team(Game *game, int port, bool binary) {
     Team *opposing = malloc(sizeof(Team));
-    if (connect_to_port(port, &opposing->read, &opposing->write) < 0) {
+    opposing->name = NULL;
+    opposing->binary = binary;
+    if (connect_to_port(game, port, &opposing->read, &opposing->write) < 0) {
         exit_game(EXIT_CONNECT_TEAM);
     }
-
-    challenge(game, opposing);
+    return opposing;
 }
 
 /**
- * Starts a challenge thread on the specified port, then sends "donefighting"
- *     to the controller and exits the calling thread.
- * args is a ThreadGame *.
- * Can exit with protocol error, invalid port, or team disconnected on error.
+ * Closes our connection to the given team and frees it.
  */
-void *spawn_challenge_thread(void *args) {
-    ThreadGame *params = (ThreadGame *)args;
-    enter_challenge_mode(params->game, params->port);
-    fprintf(params->game->write, "donefighting\n");
-    fflush(params->game->write);
-    pthread_exit(0);
+void close_team(Team *opposing) {
+    fclose(opposing->read);
+    fclose(opposing->write);
+    free(opposing->name);
+    free(opposing);
 }
 
 /**
- * Populates member's attacks with attacks given in the line.
- * Attacks should be space-separated with no leading or trailing space.
- * Exits with invalid team file contents if attacks invalid.
+ * Returns our connection to the team listening on the given port, connecting
+ *     to it if we have not challenged it before. New connections use binary
+ *     frames if binary is true. Thread-safe.
+ * Exits with team connection error if we cannot connect.
  */
-void read_team_attacks(char *line, Game *game, Member *member) {
-    int pos = 0;
-    if (pos >= strlen(line)) {
-        exit_game(EXIT_TEAM_FILE_CONTENTS); // no attacks
-    }
-
-    // read attacks until we have reached the end of the line
-    AttackNode *tail;
-    while (pos < strlen(line)) {
-        // get attack
-        char *attackName = get_token_update_pos(line, ' ', &pos);
-        Attack *attack = get_attack(game, attackName);
-        free(attackName);
-        if (attack == NULL) {
-            exit_game(EXIT_TEAM_FILE_CONTENTS); // invalid attack
-        } else if (!legal_attack(member->agent, attack)) {
-            exit_game(EXIT_TEAM_FILE_CONTENTS); // not legal attack
-        }
-
-        // Create attack node and add it to member's list
-        AttackNode *attackNode = malloc(sizeof(AttackNode));
-        attackNode->attack = attack;
-        if (member->firstAttack == NULL) {
-            member->firstAttack = attackNode;
-        } else {
-            tail->next = attackNode;
+Team *get_peer(Game *game, int port, bool binary) {
+    struct Peers *peers = game->peers;
+    Team *opposing = NULL;
+    sem_wait(&peers->lock);
+    for (int i = 0; i < peers->numPeers; i++) {
+        if (peers->peers[i].port == port) {
+            opposing = peers->peers[i].opposing;
+            break;
         }
-        tail = attackNode;
+    }
+    sem_post(&peers->lock);
+    if (opposing != NULL) {
+        return opposing;
     }
 
-    // make members attacks circularly linked
-    tail->next = member->firstAttack;
-    member->nextAttack = member->firstAttack;
+    // first time we've met this team, so connect (outside the lock)
+    opposing = connect_to_team(game, port, binary);
+    sem_wait(&peers->lock);
+    peers->peers = realloc(peers->peers, sizeof(Peer) * ++peers->numPeers);
+    peers->peers[peers->numPeers - 1].port = port;
+    peers->peers[peers->numPeers - 1].opposing = opposing;
+    sem_post(&peers->lock);
+    return opposing;
 }
 
 /**
- * Reads the agents and their attacks from the given team file, and populates
- *      game struct with this information.
- * Exits with invalid team file contents if bad format or inconsistent with
- *      sinister file.
+ * Forgets and closes our connection to the team on the given port.
+ *     Thread-safe.
  */
-void read_agents(FILE *file, Game *game) {
-    for (int i = 0; i < MAX_TEAM_PLAYERS; i++) {
-        char *line = malloc(sizeof(char) * BUFFER);
-        read_line(line, BUFFER, file);
-        if (line == NULL || strlen(line) == 0) {
-            exit_game(EXIT_TEAM_FILE_CONTENTS); // empty line or EOF
-        }
-
-        // Set up agent
-        char *agentName = get_token(line, ' ');
-        Agent *agent = get_agent(game, agentName);
-        free(agentName);
-        if (agent == NULL) {
-            exit_game(EXIT_TEAM_FILE_CONTENTS); // invalid agent
+void drop_peer(Game *game, int port) {
+    struct Peers *peers = game->peers;
+    sem_wait(&peers->lock);
+    for (int i = 0; i < peers->numPeers; i++) {
+        if (peers->peers[i].port == port) {
+            close_team(peers->peers[i].opposing);
+            peers->peers[i] = peers->peers[--peers->numPeers];
+            break;
         }
-
-        // add member and their attacks to team members
-        Member *member = malloc(sizeof(Member));
-        game->team->members[i] = member;
-        member->agent = agent;
-        member->firstAttack = NULL;
-        int pos = strlen(agent->name) + 1;
-        read_team_attacks(&line[pos], game, member);
-        free(line);
     }
+    sem_post(&peers->lock);
 }
 
 /**
- * Reads a line of directions from the given file, and adds these to team data.
- * Exits with invalid team file contents if invalid characters or format.
+ * Starts a challenge on the given port.
+ * Can exit with protocol error, invalid port, or team disconnected on error.
  */
-void read_directions(FILE *file, Team *team) {
-    int c;
-    Direction *tail;
-    while ((c = fgetc(file)) != EOF) {
-        // look for letter
-        if (c == 'N' || c == 'S' || c == 'E' || c == 'W') {
-            Direction *d = malloc(sizeof(Direction));
-            d->direction = c;
-            d->next = NULL;
-            if (team->nextMove == NULL) {
-                team->nextMove = d;
-            } else {
-                tail->next = d;
-            }
-            tail = d;
-        } else {
-            exit_game(EXIT_TEAM_FILE_CONTENTS); // invalid char
-        }
-
-        // look for space
-        c = fgetc(file);
-        if (c != ' ' && c != EOF && c != '\n') {
-            exit_game(EXIT_TEAM_FILE_CONTENTS); // unexpected char (not space)
-        }
+void enter_challenge_mode(Game *game, int port) {
+    // check port validity
+    if (!valid_port(port)) {
+        exit_game(EXIT_INVALID_PORT);
     }
-
-    // make directions circularly linked
-    tail->next = team->nextMove;
+    // set up connection to opposition; nobody to vouch that they speak binary
+    challenge(game, connect_to_team(game, port, false));
 }
 
 /**
- * Populates the given game struct with team info.
+ * Challenges the team on the specified port, then sends "donefighting" to
+ *     the controller and exits the calling thread.
+ * If the controller says the team speaks binary frames, we know it keeps 
+ *     connections open between battles, so we use our pooled connection to
+ *     it. Other teams may take only one battle per connection, so they get a 
+ *     fresh one which is closed afterwards. Counted in game->stats while
+ *     it runs.
+ * args is a ThreadGame *.
+ * Can exit with protocol error, invalid port, or team disconnected on error.
  */
-void read_team_file(Game *game, char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        exit_game(EXIT_OPEN_TEAM_FILE); // cannot open file
-    }
-
-    // read teamname, agents, attacks
-    char *name = malloc(sizeof(char) * BUFFER);
-    read_line(name, BUFFER, file);
-    if (name == NULL || strlen(name) == 0) {
-        exit_game(EXIT_TEAM_FILE_CONTENTS);
-    }
-    game->team = new_team(name);
-    read_agents(file, game);
-
-    // get coords
-    char coords[BUFFER];
-    if (fgets(coords, BUFFER, file) == NULL) {
-        exit_game(EXIT_TEAM_FILE_CONTENTS); // unexpected EOF
-    }
-    int pos = 0;
-    game->team->pos = get_coords(coords, '\n', &pos);
-    if (game->team->pos->x < 0 || game->team->pos->y < 0) {
-        exit_game(EXIT_TEAM_FILE_CONTENTS); // invalid coords
+void *spawn_challenge_thread(void *args) {
+    ThreadGame *params = (ThreadGame *)args;
+    Game *game = params->game;
+    int port = params->port;
+    bool binary = params->binary && game->binary;
+    free(params);
+    if (!valid_port(port)) {
+        exit_game(EXIT_INVALID_PORT);
     }
-
-    // get directions
-    read_directions(file, game->team);
-    if (fgetc(file) != EOF) { 
-        exit_game(EXIT_TEAM_FILE_CONTENTS); // too much file
+    count_challenge_thread(game, true);
+    bool finished;
+    if (!binary) {
+        Team *opposing = connect_to_team(game, port, false);
+        finished = challenge(game, opposing);
+        close_team(opposing);
+    } else if (!(finished = challenge(game, get_peer(game, port, true)))) {
+        drop_peer(game, port);
     }
+    count_challenge_thread(game, false);
+    if (finished) {
+        tell_controller(game, OP_DONEFIGHTING, "donefighting");
+    } // otherwise they're gone, and "disco" has been sent
+    pthread_exit(0);
 }
 
 /**
@@ -697,10 +1546,17 @@ void read_team_file(Game *game, char *filename) {
  * Exits with Sinister or Team file errors if invalid data found.
  */
 void parse_game_files(Game *game, FILE *sinister, char *teamFilename) {
-    if (read_sinister_file(game, sinister) != 0) {
+    if (load_sinister_file(game, sinister) != 0) {
         exit_game(EXIT_SINISTER_FILE_CONTENTS);
     } 
-    read_team_file(game, teamFilename);
+    FILE *team = fopen(teamFilename, "r");
+    if (team == NULL) {
+        exit_game(EXIT_OPEN_TEAM_FILE); // cannot open file
+    }
+    if (read_team_file(game, team) != 0) {
+        exit_game(EXIT_TEAM_FILE_CONTENTS);
+    }
+    fclose(team);
 }
 
 /**
@@ -711,9 +1567,11 @@ void parse_game_files(Game *game, FILE *sinister, char *teamFilename) {
 void set_up_simulation(Game *game, char *teamFile) {
     char *message = malloc(sizeof(char) * BUFFER);
     // check for "sinister" message and read sinister file and team file
-    if (read_controller_msg(message, BUFFER, game->read) != SINISTER) {
+    if (read_controller_msg(&message, BUFFER, game->read) != SINISTER) {
         exit_game(EXIT_BAD_MESSAGE);
     }
+    // take up the controller's offer of binary frames, if it made one
+    game->binary = strcmp(message, "sinister " BINARY_OFFER) == 0;
     free(message);
     parse_game_files(game, game->read, teamFile);
     game->team->port = 0;
@@ -726,11 +1584,102 @@ void set_up_simulation(Game *game, char *teamFile) {
     // let controller know we're ready once we're accepting connections
     while (game->team->port == 0) {
     }
-    fprintf(game->write, "iwannaplay %d %d %s %d\n", game->team->pos->x, 
-            game->team->pos->y, game->team->name, game->team->port);
+    fprintf(game->write, "iwannaplay %d %d %s %d%s\n", game->team->pos->x, 
+            game->team->pos->y, game->team->name, game->team->port, 
+            game->binary ? " " BINARY_OFFER : "");
     fflush(game->write);
 }
 
+/**
+ * Reads the next binary frame from the controller into payload (which must 
+ *     have room for MAX_PAYLOAD bytes) and returns its type.
+ * Exits with controller disconnected if unable to read from controller, or
+ *     with protocol error if the frame is of an unknown type.
+ */
+ControllerMsgs read_controller_frame(Game *game, unsigned char *payload, 
+        int *size) {
+    int opcode = read_frame(game->read, payload, size);
+    if (opcode < 0) {
+        exit_game(EXIT_CONTROLLER_DISCO);
+    }
+    switch (opcode) {
+        case OP_BATTLE:
+            return BATTLE;
+        case OP_GAMEOVERMAN:
+            return GAMEOVERMAN;
+        case OP_WHERENOW:
+            return WHERENOW;
+        default:
+            exit_game(EXIT_BAD_MESSAGE);
+    }
+    return -1;
+}
+
+/**
+ * Moves the team to the zone at pos, and prints where it is.
+ * Exits with protocol error if the zone is invalid.
+ */
+void enter_zone(Team *team, Coords *pos) {
+    free(team->pos);
+    team->pos = pos;
+    if (team->pos->x < 0 || team->pos->y < 0) {
+        exit_game(EXIT_BAD_MESSAGE);
+    }
+    printf("Team is in zone %d %d\n", team->pos->x, team->pos->y);
+    fflush(stdout);
+}
+
+/**
+ * Starts a challenge mode thread for the team on the given port.
+ */
+void start_challenge(Game *game, int port, bool binary) {
+    ThreadGame *params = malloc(sizeof(ThreadGame));
+    params->port = port;
+    params->binary = binary;
+    params->game = game;
+    pthread_t challenger;
+    pthread_create(&challenger, NULL, spawn_challenge_thread, (void *)params);
+    pthread_detach(challenger);
+}
+
+/**
+ * Handles a "battle" message from the controller.
+ * Exits with protocol error if invalid message.
+ */
+void read_battle_msg(Game *game, char *message) {
+    int pos = strlen("battle ");
+    if (pos >= strlen(message)) {
+        exit_game(EXIT_BAD_MESSAGE);
+    }
+    enter_zone(game->team, get_coords(message, ' ', &pos));
+    
+    // start a challenge mode thread for each port 
+    while (pos < strlen(message)) {
+        char *portVal = get_token_update_pos(message, ' ', &pos);
+        start_challenge(game, number(portVal), false);
+        free(portVal);
+    }
+}
+
+/**
+ * Handles a binary battle frame from the controller.
+ * Exits with protocol error if invalid frame.
+ */
+void read_battle_frame(Game *game, unsigned char *payload, int size) {
+    if (size < 8 || (size - 8) % 3 != 0) {
+        exit_game(EXIT_BAD_MESSAGE);
+    }
+    Coords *pos = malloc(sizeof(Coords));
+    pos->x = (int)get_number(&payload[0], 4);
+    pos->y = (int)get_number(&payload[4], 4);
+    enter_zone(game->team, pos);
+
+    // start a challenge mode thread for each port, in binary if they speak it
+    for (int i = 8; i < size; i += 3) {
+        start_challenge(game, get_number(&payload[i], 2), payload[i + 2]);
+    }
+}
+
 /**
  * Runs through a simulation, communicating with the controller and other teams
  *     as necessary. Prints narratives at the end of each round.
@@ -740,44 +1689,26 @@ void set_up_simulation(Game *game, char *teamFile) {
  */
 void run_simulation(Game *game) { 
     char *message = malloc(sizeof(char) * BUFFER);
+    unsigned char *payload = malloc(sizeof(char) * MAX_PAYLOAD);
     Team *team = game->team;
 
     while (true) {
-        ControllerMsgs type = read_controller_msg(message, BUFFER, game->read);
-        if (type == BATTLE) {
-            int pos = strlen("battle ");
-            if (pos >= strlen(message)) {
-                exit_game(EXIT_BAD_MESSAGE);
-            }
-
-            // get and print our coords
-            free(team->pos);
-            team->pos = get_coords(message, ' ', &pos);
-            if (team->pos->x < 0 || team->pos->y < 0) {
-                exit_game(EXIT_BAD_MESSAGE);
-            }
-            printf("Team is in zone %d %d\n", team->pos->x, team->pos->y);
-            fflush(stdout);
-            
-            // start a challenge mode thread for each port 
-            while (pos < strlen(message)) {
-                char *portVal = get_token_update_pos(message, ' ', &pos);
-                ThreadGame *params = malloc(sizeof(ThreadGame));
-                params->port = number(portVal);
-                params->game = game;
-                free(portVal);
-                pthread_t challenger;
-                pthread_create(&challenger, NULL, spawn_challenge_thread, 
-                        (void *)params);
-                pthread_detach(challenger);
-            }
+        int size;
+        ControllerMsgs type = game->binary ? 
+                read_controller_frame(game, payload, &size) :
+                read_controller_msg(&message, BUFFER, game->read);
+        if (type == BATTLE && game->binary) {
+            read_battle_frame(game, payload, size);
+        } else if (type == BATTLE) {
+            read_battle_msg(game, message);
         } else if (type == GAMEOVERMAN) {
             print_and_free_narratives(game);
-            exit(0); // all good 
+            end_game(game); // all good
         } else if (type == WHERENOW) {
             print_and_free_narratives(game);
-            fprintf(game->write, "travel %c\n", team->nextMove->direction);
-            fflush(game->write);
+            char travel[] = "travel d";
+            travel[strlen("travel ")] = team->nextMove->direction;
+            tell_controller(game, OP_TRAVEL, travel);
             team->nextMove = team->nextMove->next; 
             continue;
         } else {
@@ -796,6 +1727,11 @@ int main(int argc, char **argv) {
     }
     ignore_sigpipe();
     Game *game = new_game();
+    new_peers(game);
+    game->localBattles = getenv(LOCAL_BATTLES_ENV) != NULL;
+    new_battle_cache(game);
+    new_team_stats(game);
+    start_team_stats(game);
     char *teamFilename = argv[2]; 
 
     if (argc == 3) {
@@ -804,7 +1740,7 @@ int main(int argc, char **argv) {
         if (!valid_port(port)) {
             exit_game(EXIT_INVALID_PORT);
         }
-        if (connect_to_port(port, &game->read, &game->write) < 0) {
+        if (connect_to_port(game, port, &game->read, &game->write) < 0) {
             exit_game(EXIT_CONNECT_CONTROLLER);
         }
         game->simulation = true;
@@ -830,5 +1766,5 @@ int main(int argc, char **argv) {
             print_and_free_narratives(game);
         }
     }
-    pthread_exit(0);
+    end_game(game);
 }
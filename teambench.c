@@ -0,0 +1,691 @@
+#include "shared.h"
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SAMPLES 10 // times the team's resource use is sampled over the run
+
+// All error exit codes
+enum ExitCodes {
+    EXIT_ARGS = 1,
+    EXIT_OPEN_FILE = 2,
+    EXIT_FILE_CONTENTS = 3,
+    EXIT_OPEN_TEAM_FILE = 4,
+    EXIT_TEAM_FILE_CONTENTS = 5,
+    EXIT_INVALID_OPPONENTS = 6,
+    EXIT_INVALID_ROUNDS = 7,
+    EXIT_START_TEAM = 8,
+    EXIT_BAD_MESSAGE = 9,
+    EXIT_SYSTEM = 10
+};
+
+// What each connection is to the harness
+enum Roles {
+    CONTROLLER, // the team's connection to us as its controller
+    LISTENER, // a fake opponent waiting to be challenged
+    WAITER, // a fake opponent the team has challenged
+    CHALLENGER // a fake opponent challenging the team
+};
+
+// Where a fake opponent's battle is up to: which message it waits for next
+enum BattleStates {
+    AWAIT_FIGHTMEIRL,
+    AWAIT_HAVEATYOU,
+    AWAIT_FIRST_OPPONENT, // the team's first member
+    AWAIT_NEXT_OPPONENT, // the team's next member, after we eliminated one
+    AWAIT_ATTACK,
+    BATTLE_OVER
+};
+
+// A connection the harness is watching. Fake opponents play the same lineup
+// as the team, so they need no team file of their own.
+typedef struct {
+    enum Roles role;
+    int fd;
+    char *input; // received but not yet processed
+    int length;
+    int capacity;
+    char output[BUFFER * 2]; // queued to send, all in one go
+    int queued;
+    int opponent; // which fake opponent this is, if it is one
+    int port; // where a listener is listening
+    enum BattleStates state;
+    int i; // index of our current member
+    int j; // index of the team's current member
+    Member member; // our current member
+    Member opponentMember; // the team's current member
+    double started; // when the battle started
+    double attacked; // when we last attacked, if waiting on a reply
+} Connection;
+
+// Everything about one harness run
+typedef struct {
+    Game *game; // sinister data, and the lineup every fake opponent plays
+    int fdEvents;
+    Connection *controller;
+    Connection **listeners; // one per fake opponent
+    int numOpponents;
+    int rounds;
+    int port; // the team's port for challengers
+    pid_t team;
+    int battles; // finished this run
+    int active; // battles not yet over this round
+    int doneFighting; // "donefighting"s received this round
+    bool travelled; // the team has answered "wherenow?"
+    Histogram attacks; // from our attack to the team's reply
+    Histogram battleTimes;
+    Histogram roundTimes;
+} Harness;
+
+/**
+ * Exits the program with the given status and corresponding error message
+ */
+void exit_harness(int status) {
+    char *message;
+    switch (status) {
+        case EXIT_ARGS:
+            message = "Usage: 2310teambench team sinisterfile teamfile "
+                    "opponents rounds";
+            break;
+        case EXIT_OPEN_FILE:
+            message = "Unable to access sinister file";
+            break;
+        case EXIT_FILE_CONTENTS:
+            message = "Error reading sinister file";
+            break;
+        case EXIT_OPEN_TEAM_FILE:
+            message = "Unable to access team file";
+            break;
+        case EXIT_TEAM_FILE_CONTENTS:
+            message = "Error reading team file";
+            break;
+        case EXIT_INVALID_OPPONENTS:
+            message = "Invalid number of opponents";
+            break;
+        case EXIT_INVALID_ROUNDS:
+            message = "Invalid number of rounds";
+            break;
+        case EXIT_START_TEAM:
+            message = "Unable to start team";
+            break;
+        case EXIT_BAD_MESSAGE:
+            message = "Protocol error";
+            break;
+        case EXIT_SYSTEM:
+            message = "System error";
+            break;
+        default:
+            message = "Well, this is awkward";
+    }
+    fprintf(stderr, "%s\n", message);
+    exit(status);
+}
+
+/**
+ * Starts watching a new connection with the given role and socket.
+ */
+Connection *watch(Harness *harness, enum Roles role, int fd) {
+    Connection *connection = malloc(sizeof(Connection));
+    connection->role = role;
+    connection->fd = fd;
+    connection->capacity = BUFFER;
+    connection->input = malloc(sizeof(char) * connection->capacity);
+    connection->length = 0;
+    connection->queued = 0;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(harness->fdEvents, EPOLL_CTL_ADD, fd, &event) != 0) {
+        exit_harness(EXIT_SYSTEM);
+    }
+    return connection;
+}
+
+/**
+ * Stops watching the connection, closes it and frees it.
+ */
+void drop(Harness *harness, Connection *connection) {
+    epoll_ctl(harness->fdEvents, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->input);
+    free(connection);
+}
+
+/**
+ * Queues the formatted message on the connection, to go out with the rest of
+ *      the turn's messages when the connection is flushed.
+ */
+void queue_message(Connection *connection, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    connection->queued += vsnprintf(&connection->output[connection->queued],
+            sizeof(connection->output) - connection->queued, format, args);
+    va_end(args);
+}
+
+/**
+ * Sends everything queued on the connection.
+ * Exits with protocol error if the team has hung up.
+ */
+void flush(Connection *connection) {
+    if (write_all(connection->fd, connection->output, 
+            connection->queued) != 0) {
+        exit_harness(EXIT_BAD_MESSAGE);
+    }
+    connection->queued = 0;
+}
+
+/**
+ * Returns a copy of the team's member at index i, ready to be sent out.
+ * Sends "iselectyou" for it, on behalf of the connection's fake opponent.
+ */
+Member select_member(Harness *harness, Connection *connection, int i) {
+    queue_message(connection, "iselectyou %s\n",
+            harness->game->team->members[i]->agent->name);
+    return fresh_member(harness->game->team, i);
+}
+
+/**
+ * Ends the connection's battle.
+ */
+void end_battle(Harness *harness, Connection *connection) {
+    connection->state = BATTLE_OVER;
+    record_latency(&harness->battleTimes, now_ms() - connection->started);
+    harness->battles++;
+    harness->active--;
+}
+
+/**
+ * Attacks the team's current member with ours, then waits for the team's
+ *      reply: its next member if ours eliminated its current one, otherwise
+ *      its attack.
+ */
+void strike(Harness *harness, Connection *connection) {
+    Game *game = harness->game;
+    Member *member = &connection->member;
+    Attack *attack = game->attacks[member->attacks[member->nextAttack]];
+    member->nextAttack = (member->nextAttack + 1) % member->numAttacks;
+    queue_message(connection, "attack %s %s\n", member->agent->name,
+            attack->name);
+    connection->attacked = now_ms();
+
+    Member *defender = &connection->opponentMember;
+    defender->health -= get_effectiveness(game, attack, defender->agent);
+    if (defender->health > 0) {
+        connection->state = AWAIT_ATTACK;
+    } else if (++connection->j == MAX_TEAM_PLAYERS) {
+        end_battle(harness, connection); // we won
+    } else {
+        connection->state = AWAIT_NEXT_OPPONENT;
+        connection->attacked = 0;
+    }
+}
+
+/**
+ * Returns the team's member named in an "iselectyou" message.
+ * Exits with protocol error if the message isn't a valid "iselectyou".
+ */
+Member get_selected(Harness *harness, char *line) {
+    int pos = strlen("iselectyou ");
+    if (strncmp(line, "iselectyou ", pos) != 0) {
+        exit_harness(EXIT_BAD_MESSAGE);
+    }
+    Agent *agent = get_agent(harness->game, &line[pos]);
+    if (agent == NULL) {
+        exit_harness(EXIT_BAD_MESSAGE);
+    }
+    Member member;
+    member.agent = agent;
+    member.health = MAX_HEALTH;
+    return member;
+}
+
+/**
+ * Takes the team's attack on our current member, then replies: sending out
+ *      our next member first if the attack eliminated ours.
+ * Exits with protocol error if the message isn't a valid attack.
+ */
+void get_attacked(Harness *harness, Connection *connection, char *line) {
+    int pos = strlen("attack ");
+    if (strncmp(line, "attack ", pos) != 0) {
+        exit_harness(EXIT_BAD_MESSAGE);
+    }
+    char *agentName = get_token_update_pos(line, ' ', &pos);
+    Attack *attack = get_attack(harness->game, &line[pos]);
+    bool valid = attack != NULL &&
+            strcmp(agentName, connection->opponentMember.agent->name) == 0 &&
+            legal_attack(connection->opponentMember.agent, attack);
+    free(agentName);
+    if (!valid) {
+        exit_harness(EXIT_BAD_MESSAGE);
+    }
+    if (connection->attacked > 0) {
+        record_latency(&harness->attacks, now_ms() - connection->attacked);
+    }
+
+    Member *member = &connection->member;
+    member->health -= get_effectiveness(harness->game, attack, member->agent);
+    if (member->health <= 0) {
+        if (++connection->i == MAX_TEAM_PLAYERS) {
+            end_battle(harness, connection); // they won
+            return;
+        }
+        connection->member = select_member(harness, connection,
+                connection->i);
+    }
+    strike(harness, connection);
+}
+
+/**
+ * Advances a fake opponent's battle with the next line from the team,
+ *      replying as a real team would.
+ * Exits with protocol error if the line isn't what the battle expects.
+ */
+void step_battle(Harness *harness, Connection *connection, char *line) {
+    switch (connection->state) {
+        case AWAIT_FIGHTMEIRL:
+            if (strncmp(line, "fightmeirl ", strlen("fightmeirl ")) != 0) {
+                exit_harness(EXIT_BAD_MESSAGE);
+            }
+            queue_message(connection, "haveatyou opp%d\n",
+                    connection->opponent);
+            connection->state = AWAIT_FIRST_OPPONENT;
+            break;
+        case AWAIT_HAVEATYOU:
+            if (strncmp(line, "haveatyou ", strlen("haveatyou ")) != 0) {
+                exit_harness(EXIT_BAD_MESSAGE);
+            }
+            connection->member = select_member(harness, connection, 0);
+            connection->state = AWAIT_FIRST_OPPONENT;
+            break;
+        case AWAIT_FIRST_OPPONENT:
+            connection->opponentMember = get_selected(harness, line);
+            if (connection->role == CHALLENGER) {
+                strike(harness, connection); // challenger attacks first
+            } else {
+                connection->member = select_member(harness, connection, 0);
+                connection->state = AWAIT_ATTACK;
+            }
+            break;
+        case AWAIT_NEXT_OPPONENT:
+            connection->opponentMember = get_selected(harness, line);
+            connection->state = AWAIT_ATTACK;
+            break;
+        case AWAIT_ATTACK:
+            get_attacked(harness, connection, line);
+            break;
+        default:
+            exit_harness(EXIT_BAD_MESSAGE); // nothing expected after the end
+    }
+}
+
+/**
+ * Handles the next line from the team on its controller connection.
+ * Exits with protocol error if it isn't "iwannaplay", "donefighting" or a
+ *      travel.
+ */
+void hear_from_team(Harness *harness, char *line) {
+    if (strncmp(line, "iwannaplay ", strlen("iwannaplay ")) == 0) {
+        harness->port = number(strrchr(line, ' ') + 1);
+        if (!valid_port(harness->port)) {
+            exit_harness(EXIT_BAD_MESSAGE);
+        }
+    } else if (strcmp(line, "donefighting") == 0) {
+        harness->doneFighting++;
+    } else if (strncmp(line, "travel ", strlen("travel ")) == 0) {
+        harness->travelled = true;
+    } else {
+        exit_harness(EXIT_BAD_MESSAGE);
+    }
+}
+
+/**
+ * Starts a new battle against the team on the connection, as the given
+ *      fake opponent.
+ */
+void start_battle(Harness *harness, Connection *connection, int opponent) {
+    connection->opponent = opponent;
+    connection->state = connection->role == CHALLENGER ? AWAIT_HAVEATYOU :
+            AWAIT_FIGHTMEIRL;
+    connection->i = 0;
+    connection->j = 0;
+    connection->started = now_ms();
+    connection->attacked = 0;
+    harness->active++;
+}
+
+/**
+ * Accepts the team's challenge to the listener's fake opponent.
+ */
+void accept_challenge(Harness *harness, Connection *listener) {
+    int fd = accept(listener->fd, NULL, NULL);
+    if (fd < 0) {
+        exit_harness(EXIT_SYSTEM);
+    }
+    start_battle(harness, watch(harness, WAITER, fd), listener->opponent);
+}
+
+/**
+ * Reads whatever has arrived on the connection and handles each complete
+ *      line. Fake opponents' connections are dropped when the team hangs up
+ *      after their battle.
+ * Exits with protocol error if the team hangs up early.
+ */
+void handle_connection(Harness *harness, Connection *connection) {
+    if (connection->role == LISTENER) {
+        accept_challenge(harness, connection);
+        return;
+    }
+    if (connection->length == connection->capacity) {
+        connection->capacity *= 2;
+        connection->input = realloc(connection->input, sizeof(char) *
+                connection->capacity);
+    }
+    ssize_t n = read(connection->fd, &connection->input[connection->length],
+            connection->capacity - connection->length);
+    if (n < 0 && errno == EINTR) {
+        return;
+    } else if (n <= 0) {
+        if (connection->role == CONTROLLER || connection->length > 0 ||
+                connection->state != BATTLE_OVER) {
+            exit_harness(EXIT_BAD_MESSAGE);
+        }
+        drop(harness, connection);
+        return;
+    }
+    connection->length += n;
+
+    char *end;
+    int consumed = 0;
+    while ((end = memchr(&connection->input[consumed], '\n',
+            connection->length - consumed)) != NULL) {
+        *end = '\0';
+        if (connection->role == CONTROLLER) {
+            hear_from_team(harness, &connection->input[consumed]);
+        } else {
+            step_battle(harness, connection, &connection->input[consumed]);
+        }
+        consumed = end - connection->input + 1;
+    }
+    connection->length -= consumed;
+    memmove(connection->input, &connection->input[consumed],
+            connection->length);
+    flush(connection);
+    if (connection->role == CHALLENGER && connection->state == BATTLE_OVER) {
+        drop(harness, connection); // the team keeps challengers' connections
+    }
+}
+
+/**
+ * Handles events until done() says the harness has what it is waiting for.
+ */
+void wait_for(Harness *harness, bool (*done)(Harness *)) {
+    struct epoll_event events[BUFFER];
+    while (!done(harness)) {
+        int n = epoll_wait(harness->fdEvents, events, BUFFER, -1);
+        if (n < 0 && errno != EINTR) {
+            exit_harness(EXIT_SYSTEM);
+        }
+        for (int i = 0; i < n; i++) {
+            handle_connection(harness, events[i].data.ptr);
+        }
+    }
+}
+
+/**
+ * Returns true once every battle in the round is over and the team has said
+ *      so for each of them.
+ */
+bool round_over(Harness *harness) {
+    return harness->active == 0 &&
+            harness->doneFighting == 2 * harness->numOpponents;
+}
+
+/**
+ * Returns true once the team has answered "wherenow?".
+ */
+bool travelled(Harness *harness) {
+    return harness->travelled;
+}
+
+/**
+ * Opens a listening socket for each fake opponent.
+ */
+void open_listeners(Harness *harness) {
+    harness->listeners = malloc(sizeof(Connection *) * harness->numOpponents);
+    for (int i = 0; i < harness->numOpponents; i++) {
+        int port = 0;
+        int fd = open_listen(&port);
+        if (fd < 0) {
+            exit_harness(EXIT_SYSTEM);
+        }
+        harness->listeners[i] = watch(harness, LISTENER, fd);
+        harness->listeners[i]->opponent = i;
+        harness->listeners[i]->port = port;
+    }
+}
+
+/**
+ * Returns true once the team has said which port it is waiting on.
+ */
+bool ready(Harness *harness) {
+    return harness->port != 0;
+}
+
+/**
+ * Starts the team at path in simulation mode, connected to us as its
+ *      controller, and takes it through to its "iwannaplay".
+ * Exits with start team error if it can't be started or doesn't connect.
+ */
+void start_team(Harness *harness, char *path, char *sinisterFile,
+        char *teamFile) {
+    FILE *sinister = fopen(sinisterFile, "r");
+    char *message = NULL;
+    size_t size;
+    FILE *stream = open_memstream(&message, &size);
+    fprintf(stream, "sinister\n");
+    int c;
+    while ((c = fgetc(sinister)) != EOF) {
+        fputc(c, stream);
+    }
+    fclose(sinister);
+    fclose(stream);
+
+    int port = 0;
+    int fdServer = open_listen(&port);
+    char portVal[BUFFER];
+    sprintf(portVal, "%d", port);
+    harness->team = fork();
+    if (harness->team == 0) {
+        freopen("/dev/null", "w", stdout); // narratives aren't checked here
+        execl(path, path, portVal, teamFile, (char *)NULL);
+        _exit(127);
+    }
+    int fd = accept(fdServer, NULL, NULL);
+    close(fdServer);
+    if (harness->team < 0 || fd < 0 || write_all(fd, message, size) != 0) {
+        exit_harness(EXIT_START_TEAM);
+    }
+    free(message);
+    harness->controller = watch(harness, CONTROLLER, fd);
+    harness->port = 0;
+    wait_for(harness, ready);
+}
+
+/**
+ * Runs one round: sends the team a battle message naming every fake
+ *      opponent, has every fake opponent challenge the team at the same time,
+ *      then waits for all of the battles and the team's "donefighting"s.
+ */
+void run_round(Harness *harness) {
+    double start = now_ms();
+    char *message = NULL;
+    size_t size;
+    FILE *stream = open_memstream(&message, &size);
+    fprintf(stream, "battle 0 0");
+    for (int i = 0; i < harness->numOpponents; i++) {
+        fprintf(stream, " %d", harness->listeners[i]->port);
+    }
+    fprintf(stream, "\n");
+    fclose(stream);
+    if (write_all(harness->controller->fd, message, size) != 0) {
+        exit_harness(EXIT_BAD_MESSAGE);
+    }
+    free(message);
+
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(harness->port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < harness->numOpponents; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&address,
+                sizeof(address)) != 0) {
+            exit_harness(EXIT_BAD_MESSAGE);
+        }
+        Connection *connection = watch(harness, CHALLENGER, fd);
+        start_battle(harness, connection, i);
+        queue_message(connection, "fightmeirl opp%d\n", i);
+        flush(connection);
+    }
+
+    harness->doneFighting = 0;
+    wait_for(harness, round_over);
+    record_latency(&harness->roundTimes, now_ms() - start);
+}
+
+/**
+ * Prints the team's thread count, open file descriptors and resident memory
+ *      after the given round.
+ */
+void sample_team(Harness *harness, int round) {
+    char path[BUFFER];
+    sprintf(path, "/proc/%d/status", harness->team);
+    FILE *status = fopen(path, "r");
+    int threads = 0;
+    long rss = 0;
+    char line[BUFFER];
+    while (status != NULL && fgets(line, BUFFER, status) != NULL) {
+        sscanf(line, "Threads: %d", &threads);
+        sscanf(line, "VmRSS: %ld", &rss);
+    }
+    if (status != NULL) {
+        fclose(status);
+    }
+
+    int fds = 0;
+    sprintf(path, "/proc/%d/fd", harness->team);
+    DIR *dir = opendir(path);
+    while (dir != NULL && readdir(dir) != NULL) {
+        fds++;
+    }
+    if (dir != NULL) {
+        closedir(dir);
+        fds -= 2; // . and ..
+    }
+    printf("round %d threads %d fds %d rss %ld kB\n", round, threads, fds,
+            rss);
+}
+
+/**
+ * Prints the p50 and p99 (ms) of the histogram, after its name.
+ */
+void report_latencies(const char *name, Histogram *histogram) {
+    printf(" %s p50 %.3f p99 %.3f", name,
+            histogram_percentile(histogram, histogram->samples, 50),
+            histogram_percentile(histogram, histogram->samples, 99));
+}
+
+/**
+ * Prints the run's results: battles, battles per second, then p50 and p99
+ *      (ms) of attack round trips, battles and rounds.
+ */
+void report(Harness *harness, double elapsed) {
+    printf("battles %d battles/s %.1f", harness->battles,
+            harness->battles * 1000.0 / elapsed);
+    report_latencies("attack", &harness->attacks);
+    report_latencies("battle", &harness->battleTimes);
+    report_latencies("round", &harness->roundTimes);
+    printf("\n");
+}
+
+/**
+ * Drives one real 2310team in simulation mode, standing in for both its
+ *      controller and the teams it battles. Every round, the team challenges
+ *      each fake opponent and each fake opponent challenges it, so both its
+ *      challenge threads and its wait mode are kept busy. The fake opponents
+ *      play the team's own lineup.
+ */
+int main(int argc, char **argv) {
+    if (argc != 6) {
+        exit_harness(EXIT_ARGS);
+    }
+    Harness *harness = malloc(sizeof(Harness));
+    harness->game = new_game();
+    FILE *sinister = fopen(argv[2], "r");
+    if (sinister == NULL) {
+        exit_harness(EXIT_OPEN_FILE);
+    }
+    if (load_sinister_file(harness->game, sinister) != 0) {
+        exit_harness(EXIT_FILE_CONTENTS);
+    }
+    fclose(sinister);
+    FILE *team = fopen(argv[3], "r");
+    if (team == NULL) {
+        exit_harness(EXIT_OPEN_TEAM_FILE);
+    }
+    if (read_team_file(harness->game, team) != 0) {
+        exit_harness(EXIT_TEAM_FILE_CONTENTS);
+    }
+    fclose(team);
+    harness->numOpponents = number(argv[4]);
+    harness->rounds = number(argv[5]);
+    if (harness->numOpponents <= 0) {
+        exit_harness(EXIT_INVALID_OPPONENTS);
+    } else if (harness->rounds <= 0) {
+        exit_harness(EXIT_INVALID_ROUNDS);
+    }
+    harness->battles = 0;
+    harness->active = 0;
+    init_histogram(&harness->attacks);
+    init_histogram(&harness->battleTimes);
+    init_histogram(&harness->roundTimes);
+    ignore_sigpipe();
+
+    harness->fdEvents = epoll_create1(0);
+    if (harness->fdEvents < 0) {
+        exit_harness(EXIT_SYSTEM);
+    }
+    open_listeners(harness);
+    start_team(harness, argv[1], argv[2], argv[3]);
+
+    double start = now_ms();
+    int every = harness->rounds < SAMPLES ? 1 : harness->rounds / SAMPLES;
+    sample_team(harness, 0);
+    for (int round = 1; round <= harness->rounds; round++) {
+        run_round(harness);
+        if (round % every == 0) {
+            sample_team(harness, round);
+        }
+        if (round < harness->rounds) {
+            harness->travelled = false;
+            queue_message(harness->controller, "wherenow?\n");
+            flush(harness->controller);
+            wait_for(harness, travelled);
+        }
+    }
+    report(harness, now_ms() - start);
+    queue_message(harness->controller, "gameoverman\n");
+    flush(harness->controller);
+    int status;
+    waitpid(harness->team, &status, 0);
+    return 0;
+}